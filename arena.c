@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "arena.h"
+
+
+static ArenaBlock* new_block(Arena* arena, size_t size)
+{
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+    block->size = size;
+    block->used = 0;
+    arena->block_allocations++;
+
+    return block;
+}
+
+void initialize_arena(Arena* arena, size_t block_size)
+{
+    arena->block_size = block_size;
+    arena->allocations = 0;
+    arena->block_allocations = 0;
+    arena->allocated_bytes = 0;
+    arena->blocks = new_block(arena, block_size);
+    arena->blocks->next = NULL;
+}
+
+void* arena_alloc(Arena* arena, size_t size)
+{
+    size = (size + 15) & ~(size_t) 15;
+    arena->allocations++;
+    arena->allocated_bytes += size;
+
+    ArenaBlock* block = arena->blocks;
+    if (block->size - block->used < size) {
+        if (size > arena->block_size / 4) {
+            // big allocations get a block of their own, so the current block can still be filled up
+            ArenaBlock* big_block = new_block(arena, size);
+            big_block->used = size;
+            big_block->next = block->next;
+            block->next = big_block;
+            return big_block->data;
+        }
+        block = new_block(arena, arena->block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    void* allocation = block->data + block->used;
+    block->used += size;
+
+    return allocation;
+}
+
+void reset_arena(Arena* arena)
+{
+    ArenaBlock* kept = NULL;
+    for (ArenaBlock* block = arena->blocks, *next; block; block = next) {
+        next = block->next;
+        if (!kept && block->size == arena->block_size)
+            kept = block;
+        else
+            free(block);
+    }
+    if (!kept)
+        kept = new_block(arena, arena->block_size);
+    kept->used = 0;
+    kept->next = NULL;
+    arena->blocks = kept;
+}
+
+void free_arena(Arena* arena)
+{
+    for (ArenaBlock* block = arena->blocks, *next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    arena->blocks = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+typedef struct arena_block {
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    _Alignas(16) uint8_t data[];
+} ArenaBlock;
+
+// bump allocator; everything allocated from an arena is released at once by reset_arena or free_arena
+typedef struct arena {
+    ArenaBlock* blocks; // the block currently allocated from comes first
+    size_t block_size;
+    uint64_t allocations; // amount of arena_alloc calls
+    uint64_t block_allocations; // amount of blocks malloc'ed to serve them
+    uint64_t allocated_bytes;
+} Arena;
+
+void initialize_arena(Arena* arena, size_t block_size);
+
+// returns 16 byte aligned memory that stays valid until the arena is reset or freed
+void* arena_alloc(Arena* arena, size_t size);
+
+// releases all allocations, but keeps the first block around for reuse
+void reset_arena(Arena* arena);
+
+void free_arena(Arena* arena);
+
+// for lists that are allocated once with their final size; they must never grow (add_object would realloc them)
+#define initialize_list_arena(list, size, arena) do { \
+    (list)->length = 0; \
+    (list)->allocated_length = size; \
+    (list)->objects = arena_alloc(arena, (size) * sizeof((list)->objects[0])); \
+} while (0)
+
+#endif
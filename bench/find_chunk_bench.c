@@ -0,0 +1,85 @@
+// Compares looking up chunks by id with a binary search of the sorted chunk list (find_object_s, which find_chunk
+// used to do) and with the hash index find_chunk uses now, on the same synthetic chunk set. A quarter of the lookups
+// are for ids that aren't in it. Usage: find_chunk_bench [chunk count] [lookup count] [runs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "../defs.h"
+#include "../general_utils.h"
+#include "../hash_index.h"
+#include "../list.h"
+#include "../rman.h"
+
+
+static uint64_t next_random(uint64_t* state)
+{
+    // xorshift64*, good enough for ids and the same on every run
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t chunk_count = argc > 1 ? strtoul(argv[1], NULL, 0) : 4 * 1024 * 1024;
+    uint32_t lookup_count = argc > 2 ? strtoul(argv[2], NULL, 0) : 8 * 1024 * 1024;
+    int runs = argc > 3 ? atoi(argv[3]) : 5;
+    if (chunk_count == 0) {
+        eprintf("Error: There have to be chunks to look up.\n");
+        return EXIT_FAILURE;
+    }
+    ChunkList chunks;
+    initialize_list_size(&chunks, chunk_count);
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        add_object(&chunks, (&(Chunk) {.chunk_id = next_random(&state), .bundle_offset = i}));
+    }
+    // like a parsed manifest: sorted by id, with the index built over the sorted list
+    radix_sort_list(&chunks, chunk_id);
+    HashIndex chunk_index;
+    initialize_hash_index(&chunk_index, chunk_count);
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        hash_index_insert(&chunk_index, chunks.objects[i].chunk_id, i);
+    }
+    uint64_t* lookups = malloc(max(lookup_count, (uint32_t) 1) * sizeof(uint64_t));
+    for (uint32_t i = 0; i < lookup_count; i++) {
+        uint64_t random = next_random(&state);
+        lookups[i] = (random & 3) == 0 ? next_random(&state) : chunks.objects[(random >> 2) % chunk_count].chunk_id;
+    }
+
+    uint64_t best_search = UINT64_MAX, best_index = UINT64_MAX;
+    for (int run = 0; run < runs; run++) {
+        // sums of the found chunks' positions, which also keep the lookups from being optimized away
+        uint64_t search_sum = 0, index_sum = 0;
+        uint64_t start = nanoseconds();
+        for (uint32_t i = 0; i < lookup_count; i++) {
+            Chunk* chunk = NULL;
+            find_object_s(&chunks, chunk, chunk_id, lookups[i]);
+            search_sum += chunk ? (uint64_t) (chunk - chunks.objects) + 1 : 0;
+        }
+        uint64_t middle = nanoseconds();
+        for (uint32_t i = 0; i < lookup_count; i++) {
+            uint32_t index = hash_index_find(&chunk_index, lookups[i]);
+            index_sum += index == HASH_INDEX_EMPTY ? 0 : (uint64_t) index + 1;
+        }
+        uint64_t end = nanoseconds();
+        best_search = min(best_search, middle - start);
+        best_index = min(best_index, end - middle);
+        if (search_sum != index_sum) {
+            eprintf("Error: The lookups disagree.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%u lookups in %u chunks, best of %d runs:\n", lookup_count, chunk_count, runs);
+    printf("  find_object_s   %8.1f ms (%.1f ns per lookup)\n", best_search / 1e6, (double) best_search / max(lookup_count, (uint32_t) 1));
+    printf("  hash_index_find %8.1f ms (%.1f ns per lookup, %.1fx)\n", best_index / 1e6, (double) best_index / max(lookup_count, (uint32_t) 1), (double) best_search / max(best_index, (uint64_t) 1));
+    free(lookups);
+    free_hash_index(&chunk_index);
+    free(chunks.objects);
+
+    return EXIT_SUCCESS;
+}
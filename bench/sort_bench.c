@@ -0,0 +1,84 @@
+// Compares the merge sort (sort_list) with the radix sort (radix_sort_list) that sorts the chunks of a manifest by
+// chunk_id, on a synthetic chunk list of random ids. Usage: sort_bench [chunk count] [runs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "../defs.h"
+#include "../general_utils.h"
+#include "../list.h"
+#include "../rman.h"
+
+
+static uint64_t next_random(uint64_t* state)
+{
+    // xorshift64*, good enough for ids and the same on every run
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+static void copy_chunks(ChunkList* to, const ChunkList* from)
+{
+    initialize_list_size(to, from->length);
+    add_objects(to, from->objects, from->length);
+}
+
+static bool sorted_alike(const ChunkList* a, const ChunkList* b)
+{
+    for (uint32_t i = 0; i < a->length; i++) {
+        if (a->objects[i].chunk_id != b->objects[i].chunk_id || a->objects[i].bundle_offset != b->objects[i].bundle_offset)
+            return false;
+        if (i > 0 && a->objects[i - 1].chunk_id > a->objects[i].chunk_id)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t chunk_count = argc > 1 ? strtoul(argv[1], NULL, 0) : 4 * 1024 * 1024;
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    ChunkList chunks;
+    initialize_list_size(&chunks, max(chunk_count, (uint32_t) 1));
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        add_object(&chunks, (&(Chunk) {
+            .compressed_size = next_random(&state) & 0xFFFF,
+            .uncompressed_size = next_random(&state) & 0xFFFF,
+            .chunk_id = next_random(&state),
+            .bundle_id = next_random(&state) & 0xFFFF,
+            // tells equal ids apart, to check that both sorts are stable
+            .bundle_offset = i
+        }));
+    }
+
+    uint64_t best_merge = UINT64_MAX, best_radix = UINT64_MAX;
+    for (int run = 0; run < runs; run++) {
+        ChunkList merge_sorted, radix_sorted;
+        copy_chunks(&merge_sorted, &chunks);
+        copy_chunks(&radix_sorted, &chunks);
+        uint64_t start = nanoseconds();
+        sort_list(&merge_sorted, chunk_id);
+        uint64_t middle = nanoseconds();
+        radix_sort_list(&radix_sorted, chunk_id);
+        uint64_t end = nanoseconds();
+        best_merge = min(best_merge, middle - start);
+        best_radix = min(best_radix, end - middle);
+        if (!sorted_alike(&merge_sorted, &radix_sorted)) {
+            eprintf("Error: The sorts disagree.\n");
+            return EXIT_FAILURE;
+        }
+        free(merge_sorted.objects);
+        free(radix_sorted.objects);
+    }
+    printf("%u chunks, best of %d runs:\n", chunk_count, runs);
+    printf("  sort_list       %8.1f ms\n", best_merge / 1e6);
+    printf("  radix_sort_list %8.1f ms (%.1fx)\n", best_radix / 1e6, (double) best_merge / max(best_radix, (uint64_t) 1));
+    free(chunks.objects);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "bounded_queue.h"
+#include "defs.h"
+#include "general_utils.h"
+
+
+void initialize_bounded_queue(BoundedQueue* queue, uint32_t capacity)
+{
+    size_t cell_count = 2;
+    while (cell_count < capacity)
+        cell_count *= 2;
+    queue->cells = malloc(cell_count * sizeof(struct queue_cell));
+    for (size_t i = 0; i < cell_count; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = cell_count - 1;
+    atomic_init(&queue->enqueue_position, 0);
+    atomic_init(&queue->dequeue_position, 0);
+    atomic_init(&queue->pushes, 0);
+    atomic_init(&queue->occupancy_sum, 0);
+    atomic_init(&queue->full_waits, 0);
+    atomic_init(&queue->empty_waits, 0);
+    atomic_init(&queue->push_wait_ns, 0);
+    atomic_init(&queue->pop_wait_ns, 0);
+}
+
+bool try_push(BoundedQueue* queue, void* item)
+{
+    size_t position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+    struct queue_cell* cell;
+    while (1) {
+        cell = &queue->cells[position & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (difference < 0) {
+            // the cell still holds the item of the previous lap
+            return false;
+        } else {
+            position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+        }
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&queue->pushes, 1, memory_order_relaxed);
+    // consumers may have taken this item already
+    intptr_t occupancy = (intptr_t) position - (intptr_t) atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->occupancy_sum, max(occupancy, (intptr_t) 0), memory_order_relaxed);
+    return true;
+}
+
+bool try_pop(BoundedQueue* queue, void** item)
+{
+    size_t position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+    struct queue_cell* cell;
+    while (1) {
+        cell = &queue->cells[position & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (difference < 0) {
+            // nothing was pushed to the cell in this lap yet
+            return false;
+        } else {
+            position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+        }
+    }
+    *item = cell->item;
+    // ready for the push one lap later
+    atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+
+    return true;
+}
+
+// Gives the other side of the queue time to catch up. Items are big units of work, so after a few rounds of yielding
+// a short sleep costs next to nothing, while spinning would take the cpu from the very threads being waited for.
+static void back_off(uint32_t attempt)
+{
+    if (attempt < 16) {
+        sched_yield();
+    } else {
+        struct timespec pause = {.tv_nsec = 100 * 1000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+void queue_push(BoundedQueue* queue, void* item)
+{
+    if (try_push(queue, item))
+        return;
+    atomic_fetch_add_explicit(&queue->full_waits, 1, memory_order_relaxed);
+    uint64_t start = nanoseconds();
+    for (uint32_t attempt = 0; !try_push(queue, item); attempt++)
+        back_off(attempt);
+    atomic_fetch_add_explicit(&queue->push_wait_ns, nanoseconds() - start, memory_order_relaxed);
+}
+
+void* queue_pop(BoundedQueue* queue)
+{
+    void* item;
+    if (try_pop(queue, &item))
+        return item;
+    atomic_fetch_add_explicit(&queue->empty_waits, 1, memory_order_relaxed);
+    uint64_t start = nanoseconds();
+    for (uint32_t attempt = 0; !try_pop(queue, &item); attempt++)
+        back_off(attempt);
+    atomic_fetch_add_explicit(&queue->pop_wait_ns, nanoseconds() - start, memory_order_relaxed);
+
+    return item;
+}
+
+void free_bounded_queue(BoundedQueue* queue)
+{
+    free(queue->cells);
+}
@@ -0,0 +1,45 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Fixed-size lock-free queue of pointers for any number of producers and consumers (Vyukov's bounded MPMC queue):
+// every cell carries a sequence number telling whether it's ready to be written or read in the current lap, so a
+// push or pop is a single compare-and-swap on the respective position. Also tracks how full the queue was and how
+// long its users had to wait, to tell which side of it is the bottleneck.
+typedef struct bounded_queue {
+    struct queue_cell {
+        atomic_size_t sequence;
+        void* item;
+    }* cells;
+    size_t mask;
+    // on separate cache lines, so that producers and consumers don't keep stealing each other's line
+    _Alignas(64) atomic_size_t enqueue_position;
+    _Alignas(64) atomic_size_t dequeue_position;
+    _Alignas(64) atomic_uint_fast64_t pushes;
+    atomic_uint_fast64_t occupancy_sum; // items already queued at each push
+    atomic_uint_fast64_t full_waits;
+    atomic_uint_fast64_t empty_waits;
+    atomic_uint_fast64_t push_wait_ns;
+    atomic_uint_fast64_t pop_wait_ns;
+} BoundedQueue;
+
+// capacity is rounded up to a power of two
+void initialize_bounded_queue(BoundedQueue* queue, uint32_t capacity);
+
+bool try_push(BoundedQueue* queue, void* item);
+
+bool try_pop(BoundedQueue* queue, void** item);
+
+// waits for a free cell if the queue is full
+void queue_push(BoundedQueue* queue, void* item);
+
+// waits for an item if the queue is empty
+void* queue_pop(BoundedQueue* queue);
+
+void free_bounded_queue(BoundedQueue* queue);
+
+#endif
@@ -0,0 +1,139 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+    #include <sys/mman.h>
+#endif
+
+#include "bundle_cache.h"
+#include "defs.h"
+#include "rman.h"
+
+#ifndef _WIN32
+
+void initialize_bundle_cache(BundleCache* cache, uint32_t bundle_count, uint32_t capacity)
+{
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->bundles = calloc(max(bundle_count, (uint32_t) 1), sizeof(MappedBundle));
+    cache->capacity = max(capacity, (uint32_t) 1);
+    cache->mapped_count = 0;
+    cache->oldest = NULL;
+    cache->newest = NULL;
+    cache->mappings = 0;
+}
+
+static void unlink_unused(BundleCache* cache, MappedBundle* bundle)
+{
+    if (bundle->older) {
+        bundle->older->newer = bundle->newer;
+    } else {
+        cache->oldest = bundle->newer;
+    }
+    if (bundle->newer) {
+        bundle->newer->older = bundle->older;
+    } else {
+        cache->newest = bundle->older;
+    }
+    bundle->older = bundle->newer = NULL;
+}
+
+static void unmap_bundle(BundleCache* cache, MappedBundle* bundle)
+{
+    munmap((void*) bundle->data, bundle->size);
+    bundle->data = NULL;
+    cache->mapped_count--;
+}
+
+MappedBundle* acquire_bundle(BundleCache* cache, uint32_t index, const char* path)
+{
+    MappedBundle* bundle = &cache->bundles[index];
+    // mapping is quick compared to what's done with a bundle afterwards, so it's fine to do it under the lock
+    pthread_mutex_lock(&cache->lock);
+    if (bundle->data) {
+        if (bundle->references == 0)
+            unlink_unused(cache, bundle);
+        bundle->references++;
+        pthread_mutex_unlock(&cache->lock);
+        return bundle;
+    }
+
+    int bundle_fd = open(path, O_RDONLY);
+    struct stat file_info;
+    if (bundle_fd == -1 || fstat(bundle_fd, &file_info) == -1 || file_info.st_size == 0) {
+        if (bundle_fd != -1)
+            close(bundle_fd);
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    void* data = mmap(NULL, file_info.st_size, PROT_READ, MAP_SHARED, bundle_fd, 0);
+    close(bundle_fd);
+    if (data == MAP_FAILED) {
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    // chunks are mostly a sparse selection of a bundle, so only the parts given to prefetch_chunks are read ahead
+    madvise(data, file_info.st_size, MADV_RANDOM);
+    // mappings still in use can't go, so there may be more than capacity for a while
+    while (cache->mapped_count >= cache->capacity && cache->oldest) {
+        MappedBundle* oldest = cache->oldest;
+        unlink_unused(cache, oldest);
+        unmap_bundle(cache, oldest);
+    }
+    bundle->data = data;
+    bundle->size = file_info.st_size;
+    bundle->references = 1;
+    cache->mapped_count++;
+    cache->mappings++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return bundle;
+}
+
+void release_bundle(BundleCache* cache, MappedBundle* bundle)
+{
+    pthread_mutex_lock(&cache->lock);
+    assert(bundle->references > 0);
+    if (--bundle->references == 0) {
+        bundle->older = cache->newest;
+        bundle->newer = NULL;
+        if (cache->newest) {
+            cache->newest->newer = bundle;
+        } else {
+            cache->oldest = bundle;
+        }
+        cache->newest = bundle;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void prefetch_chunks(const MappedBundle* bundle, const ChunkList* chunks)
+{
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t data = (uintptr_t) bundle->data;
+    // chunks closer together than a page are read ahead in one go
+    for (uint32_t i = 0; i < chunks->length;) {
+        uintptr_t start = (data + chunks->objects[i].bundle_offset) & ~(page_size - 1);
+        uintptr_t end = data + chunks->objects[i].bundle_offset + chunks->objects[i].compressed_size;
+        for (i++; i < chunks->length && data + chunks->objects[i].bundle_offset <= ((end + page_size - 1) & ~(page_size - 1)); i++) {
+            end = max(end, data + chunks->objects[i].bundle_offset + chunks->objects[i].compressed_size);
+        }
+        madvise((void*) start, end - start, MADV_WILLNEED);
+    }
+}
+
+void free_bundle_cache(BundleCache* cache)
+{
+    for (MappedBundle* bundle = cache->oldest; bundle; bundle = bundle->newer) {
+        munmap((void*) bundle->data, bundle->size);
+    }
+    free(cache->bundles);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef BUNDLE_CACHE_H
+#define BUNDLE_CACHE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "rman.h"
+
+// how many bundles stay mapped once they're not used anymore
+#define BUNDLE_CACHE_SIZE 64
+
+typedef struct mapped_bundle {
+    const uint8_t* data; // NULL while not mapped
+    size_t size;
+    uint32_t references;
+    struct mapped_bundle* older; // neighbours in the list of unused mappings
+    struct mapped_bundle* newer;
+} MappedBundle;
+
+// Bundle files on disk mapped into memory, so that chunks can be decompressed right from the page cache without
+// reading or copying them. Mappings are shared by all threads and kept until capacity of them aren't used anymore,
+// then the least recently used one goes. Not available on windows.
+typedef struct bundle_cache {
+    pthread_mutex_t lock;
+    MappedBundle* bundles; // one per bundle of the BundleList the cache was made for
+    uint32_t capacity;
+    uint32_t mapped_count;
+    MappedBundle* oldest; // unused mappings, least recently used first
+    MappedBundle* newest;
+    uint32_t mappings; // made in total, reused ones aren't counted
+} BundleCache;
+
+void initialize_bundle_cache(BundleCache* cache, uint32_t bundle_count, uint32_t capacity);
+
+// Maps the bundle with index (in the BundleList) at path, or takes the existing mapping. Every mapping that was
+// acquired has to be released again. Returns NULL if the bundle can't be mapped.
+MappedBundle* acquire_bundle(BundleCache* cache, uint32_t index, const char* path);
+
+void release_bundle(BundleCache* cache, MappedBundle* bundle);
+
+// asks the kernel to read the parts of bundle holding chunks (sorted by bundle_offset) ahead
+void prefetch_chunks(const MappedBundle* bundle, const ChunkList* chunks);
+
+void free_bundle_cache(BundleCache* cache);
+
+#endif
@@ -5,6 +5,7 @@
 #include <inttypes.h>
 
 extern int VERBOSE;
+extern int amount_of_threads;
 
 #ifdef _WIN32
     #define strcasestr StrStrI
@@ -14,6 +15,8 @@ extern int VERBOSE;
     #if defined(_FILE_OFFSET_BITS) && _FILE_OFFSET_BITS == 64
         #define truncate(path, length) truncate64(path, length)
     #endif
+#else
+    #define O_BINARY 0
 #endif
 
 typedef struct {
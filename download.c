@@ -1,6 +1,10 @@
 #define _FILE_OFFSET_BITS 64
-#ifdef _WIN32
-    #include <fcntl.h>
+#ifdef __linux__
+    #define _GNU_SOURCE // for O_DIRECT
+#endif
+#ifndef _WIN32
+    #include <sys/resource.h>
+    #include <sys/mman.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,332 +12,1397 @@
 #include <string.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
 #include "zstd/zstd.h"
 #include "BearSSL/inc/bearssl_ssl.h"
 #include "BearSSL/trust_anchors.h"
 
 #include "download.h"
 #include "defs.h"
+#include "file_writer.h"
 #include "general_utils.h"
+#include "job_system.h"
 #include "list.h"
+#include "malloc_stats.h"
 #include "rman.h"
 #include "socket_utils.h"
 
 
-void cleanup_variable_bundle_args(struct variable_bundle_args* args)
+static void unlink_open_file(struct open_file_list* open_files, struct output_file* output_file)
 {
-    fseeko(args->output_file, 0, SEEK_END);
-    fflush(args->output_file);
-    assert(ftruncate(fileno(args->output_file), ftello(args->output_file) - 1) == 0);
-    fclose(args->output_file);
-    free(args->index);
-    free(args->threads_visited);
-    pthread_mutex_unlock(args->index_lock);
-    pthread_mutex_destroy(args->index_lock);
-    free(args->index_lock);
-    for (uint32_t i = 0; i < args->to_download->length; i++) {
-        free(args->to_download->objects[i].chunks.objects);
+    if (output_file->older)
+        output_file->older->newer = output_file->newer;
+    else
+        open_files->oldest = output_file->newer;
+    if (output_file->newer)
+        output_file->newer->older = output_file->older;
+    else
+        open_files->newest = output_file->older;
+}
+
+static void link_newest_open_file(struct open_file_list* open_files, struct output_file* output_file)
+{
+    output_file->older = open_files->newest;
+    output_file->newer = NULL;
+    if (open_files->newest)
+        open_files->newest->newer = output_file;
+    else
+        open_files->oldest = output_file;
+    open_files->newest = output_file;
+}
+
+// called with the lock of open_files held
+static void close_output_file(struct open_file_list* open_files, struct output_file* output_file)
+{
+    if (output_file->fd == -1)
+        return;
+    unlink_open_file(open_files, output_file);
+    open_files->count--;
+    close(output_file->fd);
+    output_file->fd = -1;
+    if (output_file->direct_fd != -1)
+        close(output_file->direct_fd);
+    output_file->direct_fd = -1;
+    if (output_file->retired_direct_fd != -1)
+        close(output_file->retired_direct_fd);
+    output_file->retired_direct_fd = -1;
+}
+
+// Closes the least recently used open file no write is using right now, it gets opened again by its next batch of
+// writes. Returns false if all open files are in use. Called with the lock of open_files held.
+static bool close_unused_file(struct open_file_list* open_files)
+{
+    for (struct output_file* output_file = open_files->oldest; output_file; output_file = output_file->newer) {
+        if (output_file->users == 0) {
+            close_output_file(open_files, output_file);
+            return true;
+        }
+    }
+    return false;
+}
+
+// opens path, closing unused output files for as long as there are no descriptors left
+static int open_evicting(struct open_file_list* open_files, const char* path, int flags)
+{
+    int fd;
+    while ( (fd = open(path, flags)) == -1 && (errno == EMFILE || errno == ENFILE) && close_unused_file(open_files) );
+    return fd;
+}
+
+// Opens the output file if it isn't open and marks it used until its writes are done. Returns false if that needs
+// another descriptor while all of them (or max_count) are taken by files in use. Called with the lock of the open file
+// list held.
+static bool use_output_file(struct download_plan* plan, struct output_file* output_file)
+{
+    struct open_file_list* open_files = &plan->pipeline->open_files;
+    if (output_file->fd != -1) {
+        unlink_open_file(open_files, output_file);
+    } else {
+        if (open_files->count >= open_files->max_count && !close_unused_file(open_files))
+            return false;
+        output_file->fd = open_evicting(open_files, output_file->path, O_WRONLY | O_BINARY);
+        if (output_file->fd == -1) {
+            if (errno == EMFILE || errno == ENFILE)
+                return false;
+            eprintf("Error: Failed to open \"%s\": %s\n", output_file->path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+#ifdef __linux__
+        // stays -1 on file systems without direct i/o, then everything is written through fd
+        if (plan->direct_io && !output_file->direct_refused) {
+            output_file->direct_fd = open_evicting(open_files, output_file->path, O_WRONLY | O_DIRECT);
+            if (output_file->direct_fd != -1 && (output_file->direct_alignment = direct_io_alignment(output_file->direct_fd)) == 0) {
+                close(output_file->direct_fd);
+                output_file->direct_fd = -1;
+            }
+        }
+#endif
+        open_files->count++;
+    }
+    link_newest_open_file(open_files, output_file);
+    output_file->users++;
+
+    return true;
+}
+
+// Gives the file at path its final size, with its blocks allocated right away where possible, so that the chunks
+// written in any order afterwards end up in as few extents as possible. Returns whether the blocks were allocated.
+static bool size_output_file(const char* path, uint64_t size, bool create)
+{
+    int fd = open(path, O_WRONLY | O_BINARY | (create ? O_CREAT | O_TRUNC : 0), 0666);
+    assert(fd != -1);
+    assert(ftruncate(fd, size) == 0);
+    bool preallocated = preallocate_file(fd, size);
+    close(fd);
+
+    return preallocated;
+}
+
+static bool all_zeroes(const uint8_t* data, size_t length)
+{
+    // every byte equal to the one before it, and the first one zero
+    return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
+
+// queues writes of the decompressed data of chunk (NULL if it's all zeroes) to every place it's needed at
+static void add_chunk_writes(struct download_plan* plan, WriteBatch* batch, const Chunk* chunk, const uint8_t* data)
+{
+    uint32_t unique_index = hash_index_find(&plan->chunk_index, chunk->chunk_id);
+    assert(unique_index != HASH_INDEX_EMPTY);
+    for (uint32_t i = plan->destination_starts[unique_index]; i < plan->destination_starts[unique_index + 1]; i++) {
+        uint32_t output_index = plan->destinations[i].output_index;
+        // the fds are filled in by flush_writes, so that files are only open while their writes are done
+        FileWrite write = {
+            .fd = -1,
+            .direct_fd = -1,
+            .tag = output_index,
+            .offset = plan->destinations[i].file_offset,
+            .data = data,
+            .length = chunk->uncompressed_size
+        };
+        add_object(batch, &write);
+    }
+}
+
+// whoever does the last write to a file closes and unmaps it (a mapped file can be written through fd as well, by
+// chunks that also go to files that aren't mapped)
+static void finish_output_write(struct download_plan* plan, struct output_file* output_file)
+{
+    if (atomic_fetch_sub(&output_file->pending_writes, 1) != 1)
+        return;
+#ifndef _WIN32
+    uint8_t* mapping = atomic_exchange(&output_file->mapping, NULL);
+    if (mapping)
+        munmap(mapping, output_file->size);
+#endif
+    pthread_mutex_lock(&plan->pipeline->open_files.lock);
+    close_output_file(&plan->pipeline->open_files, output_file);
+    pthread_mutex_unlock(&plan->pipeline->open_files.lock);
+}
+
+static void decompress_chunk(ZSTD_DCtx* context, const Chunk* chunk, uint8_t* destination, const uint8_t* data)
+{
+    size_t decompressedSize = ZSTD_decompressDCtx(context, destination, chunk->uncompressed_size, data, chunk->compressed_size);
+    if (decompressedSize != chunk->uncompressed_size) {
+        eprintf("Error: ZSTD decompressed size doesn't match expected value! Expected %u, got %"PRId64"\n", chunk->uncompressed_size, decompressedSize);
+        eprintf("failing chunk id: %016"PRIx64", failing bundle id: %016"PRIx64"\n", chunk->chunk_id, chunk->bundle_id);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Does all writes of batch. If its files can't all be open at once, the writes to the ones that could be opened are
+// done first, which lets those files be closed for the others.
+static void flush_writes(struct download_plan* plan, WriteBatch* batch, FileWriter* writer)
+{
+    struct open_file_list* open_files = &plan->pipeline->open_files;
+    uint32_t start = 0;
+    while (start < batch->length) {
+        pthread_mutex_lock(&open_files->lock);
+        uint32_t end = start;
+        for (; end < batch->length && use_output_file(plan, &plan->output_files.objects[batch->objects[end].tag]); end++) {
+            struct output_file* output_file = &plan->output_files.objects[batch->objects[end].tag];
+            batch->objects[end].fd = output_file->fd;
+            batch->objects[end].direct_fd = output_file->direct_fd;
+            batch->objects[end].direct_alignment = output_file->direct_alignment;
+            batch->objects[end].direct_failed = false;
+        }
+        bool no_files_open = open_files->count == 0;
+        pthread_mutex_unlock(&open_files->lock);
+        if (end == start) {
+            // all open files are used by the other write threads, which close them soon
+            if (no_files_open) {
+                eprintf("Error: Failed to open \"%s\": %s\n", plan->output_files.objects[batch->objects[start].tag].path, strerror(EMFILE));
+                exit(EXIT_FAILURE);
+            }
+            sched_yield();
+            continue;
+        }
+
+        WriteBatch part = {.objects = batch->objects + start, .length = end - start};
+        int write_calls = write_batch(writer, &part);
+        if (write_calls == -1) {
+            eprintf("Error: Failed to write downloaded chunks: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        atomic_fetch_add(&plan->pipeline->chunk_writes, part.length);
+        atomic_fetch_add(&plan->pipeline->write_calls, write_calls);
+        pthread_mutex_lock(&open_files->lock);
+        for (uint32_t i = 0; i < part.length; i++) {
+            struct output_file* output_file = &plan->output_files.objects[part.objects[i].tag];
+            output_file->users--;
+            if (part.objects[i].direct_failed && !output_file->direct_refused) {
+                v_printf(1, "Info: Direct i/o failed for \"%s\", writing it through the page cache.\n", output_file->path);
+                output_file->direct_refused = true;
+                output_file->retired_direct_fd = output_file->direct_fd;
+                output_file->direct_fd = -1;
+            }
+        }
+        pthread_mutex_unlock(&open_files->lock);
+        for (uint32_t i = 0; i < part.length; i++) {
+            finish_output_write(plan, &plan->output_files.objects[part.objects[i].tag]);
+        }
+        start = end;
+    }
+    batch->length = 0;
+}
+
+#ifndef _WIN32
+static uint8_t* map_output_file(struct download_plan* plan, struct output_file* output_file)
+{
+    uint8_t* mapping = atomic_load(&output_file->mapping);
+    if (mapping)
+        return mapping;
+    pthread_mutex_lock(&plan->pipeline->open_files.lock);
+    mapping = atomic_load(&output_file->mapping);
+    if (!mapping) {
+        // The file has its final size and its blocks already, so running out of space showed up then instead of as
+        // SIGBUS here. The mapping stays valid without the descriptor.
+        int fd = open_evicting(&plan->pipeline->open_files, output_file->path, O_RDWR);
+        void* data = fd == -1 ? MAP_FAILED : mmap(NULL, output_file->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (fd != -1)
+            close(fd);
+        if (data == MAP_FAILED) {
+            eprintf("Error: Failed to map \"%s\"\n", output_file->path);
+            exit(EXIT_FAILURE);
+        }
+        mapping = data;
+        atomic_store(&output_file->mapping, mapping);
+    }
+    pthread_mutex_unlock(&plan->pipeline->open_files.lock);
+
+    return mapping;
+}
+
+// whether all files chunk goes to are preallocated, so that it can be decompressed into their mappings
+static bool chunk_mappable(const struct download_plan* plan, const Chunk* chunk)
+{
+    uint32_t unique_index = hash_index_find(&plan->chunk_index, chunk->chunk_id);
+    assert(unique_index != HASH_INDEX_EMPTY);
+    for (uint32_t i = plan->destination_starts[unique_index]; i < plan->destination_starts[unique_index + 1]; i++) {
+        if (!plan->output_files.objects[plan->destinations[i].output_index].preallocated)
+            return false;
+    }
+    return true;
+}
+
+// Decompresses chunk right into the mapping of its first destination and copies it from there to the others, so
+// there's neither a buffer in between nor a write call. The kernel writes the dirty pages back on its own.
+static void decompress_to_mappings(struct download_plan* plan, ZSTD_DCtx* context, const Chunk* chunk, const uint8_t* data)
+{
+    uint32_t unique_index = hash_index_find(&plan->chunk_index, chunk->chunk_id);
+    assert(unique_index != HASH_INDEX_EMPTY);
+    uint32_t start = plan->destination_starts[unique_index], end = plan->destination_starts[unique_index + 1];
+    uint8_t* first = NULL;
+#ifdef MADV_POPULATE_WRITE
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+#endif
+    for (uint32_t i = start; i < end; i++) {
+        struct output_file* output_file = &plan->output_files.objects[plan->destinations[i].output_index];
+        uint8_t* destination = map_output_file(plan, output_file) + plan->destinations[i].file_offset;
+#ifdef MADV_POPULATE_WRITE
+        // one call that makes all pages of the chunk writable, rather than a page fault for each of them
+        uintptr_t page_start = (uintptr_t) destination & ~(page_size - 1);
+        madvise((void*) page_start, (uintptr_t) destination + chunk->uncompressed_size - page_start, MADV_POPULATE_WRITE);
+#endif
+        if (first) {
+            memcpy(destination, first, chunk->uncompressed_size);
+        } else {
+            decompress_chunk(context, chunk, destination, data);
+            first = destination;
+        }
+    }
+    // only once all copies are made, the first destination's file may be unmapped by this
+    for (uint32_t i = start; i < end; i++) {
+        finish_output_write(plan, &plan->output_files.objects[plan->destinations[i].output_index]);
+    }
+    atomic_fetch_add(&plan->pipeline->chunk_writes, end - start);
+}
+#endif
+
+static void free_download_plan(struct download_plan* plan)
+{
+    free(plan->output_files.objects);
+    free(plan->unique_chunks.objects);
+    free_hash_index(&plan->chunk_index);
+    free(plan->destination_starts);
+    free(plan->destinations);
+#ifndef _WIN32
+    if (plan->bundle_cache) {
+        atomic_fetch_add(&plan->pipeline->bundle_mappings, plan->bundle_cache->mappings);
+        free_bundle_cache(plan->bundle_cache);
+        free(plan->bundle_cache);
+    }
+#endif
+    if (plan->bundles)
+        free_bundle_list(plan->bundles);
+    free(plan);
+}
+
+static void retain_plan(struct download_plan* plan)
+{
+    atomic_fetch_add(&plan->references, 1);
+}
+
+// frees plan once the last job or item about it is done, on whichever thread that happens
+static void release_plan(struct download_plan* plan)
+{
+    if (atomic_fetch_sub(&plan->references, 1) == 1)
+        free_download_plan(plan);
+}
+
+#define JOB_SIZE (4 * 1024 * 1024)
+// downloaded data passed on to the decompression threads at once, no less than a read window of get_ranges
+#define FETCH_BATCH_SIZE max(1024 * 1024, READ_WINDOW_SIZE)
+// decompressed data handed to the write threads at once, so that contiguous chunks can be merged into single writes
+#define WRITE_BATCH_SIZE (16 * 1024 * 1024)
+// existing files are verified ahead of the download in batches of about this many bytes
+#define VERIFY_BATCH_SIZE (256 * 1024 * 1024)
+// ranges of existing files at least this big are mapped to be verified, smaller ones (like most whole files) are
+// cheaper to read than to map and unmap again
+#ifndef _WIN32
+    #define VERIFY_MAP_SIZE (1024 * 1024)
+#else
+    #define VERIFY_MAP_SIZE UINT64_MAX // no mappings on windows
+#endif
+
+static void initialize_item_pool(struct item_pool* pool, size_t buffer_size, uint32_t limit)
+{
+    pool->buffer_size = buffer_size;
+    pool->limit = limit;
+    initialize_bounded_queue(&pool->free_items, limit);
+    atomic_init(&pool->allocated, 0);
+}
+
+// returns an item that was handed back, or NULL if the caller is to allocate a new one
+static void* take_pooled_item(struct item_pool* pool)
+{
+    void* item;
+    if (try_pop(&pool->free_items, &item))
+        return item;
+    if (atomic_fetch_add(&pool->allocated, 1) < pool->limit)
+        return NULL;
+    // all items are in use, so the stage they're in is behind anyway
+    atomic_fetch_sub(&pool->allocated, 1);
+
+    return queue_pop(&pool->free_items);
+}
+
+static void return_pooled_item(struct item_pool* pool, void* item)
+{
+    // never waits, the queue has room for all items there are
+    queue_push(&pool->free_items, item);
+}
+
+static void free_item_pool(struct item_pool* pool, void (*free_item)(void* item))
+{
+    void* item;
+    while (try_pop(&pool->free_items, &item)) {
+        free_item(item);
+    }
+    free_bounded_queue(&pool->free_items);
+}
+
+static struct fetched_chunks* get_fetched_chunks(struct item_pool* pool, struct download_plan* plan)
+{
+    struct fetched_chunks* fetched = take_pooled_item(pool);
+    if (!fetched) {
+        fetched = malloc(sizeof(struct fetched_chunks));
+        fetched->ranges_capacity = 64;
+        fetched->ranges = malloc(fetched->ranges_capacity * sizeof(uint8_t*));
+        fetched->buffer = pool->buffer_size ? malloc(pool->buffer_size) : NULL;
+    }
+    retain_plan(plan);
+    fetched->plan = plan;
+    fetched->used = 0;
+    fetched->mapping = NULL;
+
+    return fetched;
+}
+
+static void free_fetched_chunks(void* item)
+{
+    struct fetched_chunks* fetched = item;
+    free(fetched->ranges);
+    free(fetched->buffer);
+    free(fetched);
+}
+
+static struct chunk_writes* get_chunk_writes(struct item_pool* pool, struct download_plan* plan)
+{
+    struct chunk_writes* writes = take_pooled_item(pool);
+    if (!writes) {
+        writes = malloc(sizeof(struct chunk_writes));
+        initialize_list(&writes->batch);
+        writes->buffer = malloc(pool->buffer_size);
+    }
+    retain_plan(plan);
+    writes->plan = plan;
+    writes->batch.length = 0;
+    writes->used = 0;
+
+    return writes;
+}
+
+static void free_chunk_writes(void* item)
+{
+    struct chunk_writes* writes = item;
+    free(writes->batch.objects);
+    free(writes->buffer);
+    free(writes);
+}
+
+// passes on all fetched_chunks before the current one whose chunks are all done
+static void pass_on_done(struct fetch_sink* sink)
+{
+    while (sink->oldest != sink->current && sink->oldest->done_count == sink->oldest->chunks.length) {
+        struct fetched_chunks* next = sink->oldest->next;
+        queue_push(sink->output, sink->oldest);
+        sink->oldest = next;
+    }
+}
+
+static uint8_t* sink_buffer(void* context, uint32_t chunk_index)
+{
+    struct fetch_sink* sink = context;
+    const Chunk* chunk = &sink->chunks->objects[chunk_index];
+    if (!sink->current || sink->current->used + chunk->compressed_size > sink->pool->buffer_size) {
+        struct fetched_chunks* fetched = get_fetched_chunks(sink->pool, sink->plan);
+        fetched->chunks = (ChunkList) {.objects = (Chunk*) chunk};
+        fetched->done_count = 0;
+        if (sink->current) {
+            sink->current->next = fetched;
+        } else {
+            sink->oldest = fetched;
+        }
+        sink->current = fetched;
+        pass_on_done(sink);
+    }
+    struct fetched_chunks* fetched = sink->current;
+    if (fetched->chunks.length == fetched->ranges_capacity) {
+        fetched->ranges_capacity *= 2;
+        fetched->ranges = realloc(fetched->ranges, fetched->ranges_capacity * sizeof(uint8_t*));
+    }
+    uint8_t* range = &fetched->buffer[fetched->used];
+    fetched->ranges[fetched->chunks.length] = range;
+    fetched->chunks.length++;
+    fetched->chunks.allocated_length++;
+    fetched->used += chunk->compressed_size;
+
+    return range;
+}
+
+static void sink_done(void* context, uint32_t chunk_index)
+{
+    (void) chunk_index;
+    struct fetch_sink* sink = context;
+    // chunks are done in order, so this one belongs to the oldest fetched_chunks that still misses some
+    sink->oldest->done_count++;
+    pass_on_done(sink);
+}
+
+#ifndef _WIN32
+// passes chunks on right where they are in the mapped bundle, in batches of FETCH_BATCH_SIZE compressed bytes
+static void map_chunks(struct bundle_args* args, struct download_plan* plan, uint32_t bundle_index, const ChunkList* chunks, const char* bundle_path)
+{
+    MappedBundle* bundle = acquire_bundle(plan->bundle_cache, bundle_index, bundle_path);
+    const Chunk* last = &chunks->objects[chunks->length - 1];
+    // bundles were checked before, so this only happens if one changes during the run
+    if (!bundle || (uint64_t) last->bundle_offset + last->compressed_size > bundle->size) {
+        eprintf("Error: Failed to map bundle \"%s\"\n", bundle_path);
+        exit(EXIT_FAILURE);
+    }
+    prefetch_chunks(bundle, chunks);
+    struct fetched_chunks* fetched = NULL;
+    size_t batch_size = 0;
+    for (uint32_t i = 0; i < chunks->length; i++) {
+        const Chunk* chunk = &chunks->objects[i];
+        if (fetched && batch_size + chunk->compressed_size > (size_t) FETCH_BATCH_SIZE) {
+            queue_push(args->output, fetched);
+            fetched = NULL;
+        }
+        if (!fetched) {
+            fetched = get_fetched_chunks(args->fetch_pool, plan);
+            fetched->chunks = (ChunkList) {.objects = (Chunk*) chunk};
+            // every batch keeps the bundle mapped until it's decompressed
+            fetched->mapping = acquire_bundle(plan->bundle_cache, bundle_index, bundle_path);
+            batch_size = 0;
+        }
+        if (fetched->chunks.length == fetched->ranges_capacity) {
+            fetched->ranges_capacity *= 2;
+            fetched->ranges = realloc(fetched->ranges, fetched->ranges_capacity * sizeof(uint8_t*));
+        }
+        fetched->ranges[fetched->chunks.length] = &bundle->data[chunk->bundle_offset];
+        fetched->chunks.length++;
+        fetched->chunks.allocated_length++;
+        batch_size += chunk->compressed_size;
     }
-    free(args->to_download->objects);
-    free(args->to_download);
+    queue_push(args->output, fetched);
+    release_bundle(plan->bundle_cache, bundle);
 }
+#endif
 
-void* download_and_write_bundle(void* _args)
+void* fetch_chunks(void* _args)
 {
     struct bundle_args* args = _args;
-    uint32_t index;
     size_t bundle_base_length = strlen(bundle_base);
     char current_bundle_url[bundle_base_length + 25];
     memcpy(current_bundle_url, bundle_base, bundle_base_length);
-    bool visited = false;
-    ZSTD_DCtx* context = ZSTD_createDCtx();
-    while (1) {
-        pthread_mutex_t* lock = args->variable_args->index_lock;
-        pthread_mutex_lock(lock);
-        index = *args->variable_args->index;
-        (*args->variable_args->index)++;
-        if (!visited) {
-            (*args->variable_args->threads_visited)++;
-            visited = true;
-        }
-        if (*args->variable_args->index == args->variable_args->to_download->length) {
-            *args->file_index_finished = max(*args->file_index_finished, args->variable_args->file_index);
-        }
-        pthread_mutex_unlock(lock);
-
-        if (index >= args->variable_args->to_download->length) {
-            if (index == args->variable_args->to_download->length + (*args->variable_args->threads_visited) - 1) {
-                cleanup_variable_bundle_args(args->variable_args);
-            }
-            free(args->variable_args);
-            assert(write(args->coordinate_pipes[1], &(uint8_t) {0}, 1) == 1);
-            assert(read(args->coordinate_pipes[0], &args->variable_args, sizeof(struct variable_bundle_args*)) == sizeof(struct variable_bundle_args*));
-            visited = false;
-            if (!args->variable_args)
-                break;
+    Job job;
+    while (take_job(args->jobs, args->worker, &job)) {
+        struct download_plan* plan = args->plans[job.list];
+        Bundle* bundle = &plan->bundles->objects[job.index];
+        // split off everything past JOB_SIZE compressed bytes, so that idle workers can steal the rest of the bundle
+        uint32_t chunk_count = 1;
+        uint64_t job_size = bundle->chunks.objects[job.start].compressed_size;
+        while (chunk_count < job.count && job_size + bundle->chunks.objects[job.start + chunk_count].compressed_size <= JOB_SIZE) {
+            job_size += bundle->chunks.objects[job.start + chunk_count].compressed_size;
+            chunk_count++;
+        }
+        if (chunk_count < job.count) {
+            retain_plan(plan);
+            push_job(args->jobs, args->worker, (Job) {job.index, job.start + chunk_count, job.count - chunk_count, job.list});
+        }
+        ChunkList chunks = {
+            .length = chunk_count,
+            .allocated_length = chunk_count,
+            .objects = &bundle->chunks.objects[job.start]
+        };
 
+        sprintf(current_bundle_url + bundle_base_length, "/%016"PRIX64".bundle", bundle->bundle_id);
+#ifndef _WIN32
+        if (plan->bundle_cache) {
+            map_chunks(args, plan, job.index, &chunks, current_bundle_url);
+            finish_job(args->jobs);
+            release_plan(plan);
             continue;
         }
-
-        sprintf(current_bundle_url + bundle_base_length, "/%016"PRIX64".bundle", args->variable_args->to_download->objects[index].bundle_id);
-        uint8_t** ranges;
+#endif
+        // decompression starts while the rest of the job is still being read or downloaded
+        struct fetch_sink sink = {.plan = plan, .pool = args->fetch_pool, .output = args->output, .chunks = &chunks};
+        RangeSink range_sink = {sink_buffer, sink_done, &sink};
         if (args->filesystem_only) {
-            ranges = get_ranges(current_bundle_url, &args->variable_args->to_download->objects[index].chunks);
-            if (!ranges) {
+            if (!get_ranges(current_bundle_url, &chunks, &range_sink, &args->io)) {
                 eprintf("Make sure all required bundles exist and are accessable at \"%s\".\n", bundle_base);
                 exit(EXIT_FAILURE);
             }
         } else {
-            ranges = download_ranges(&args->ssl_structs, current_bundle_url, &args->variable_args->to_download->objects[index].chunks);
-            if (!ranges) {
+            if (!download_ranges(&args->ssl_structs, current_bundle_url, &chunks, &range_sink)) {
                 eprintf("Failed to download. Make sure to use the correct bundle base url (if necessary).\n");
                 exit(EXIT_FAILURE);
             }
         }
-        for (uint32_t j = 0; j < args->variable_args->to_download->objects[index].chunks.length; j++) {
-            uint8_t* to_write = malloc(args->variable_args->to_download->objects[index].chunks.objects[j].uncompressed_size);
-            size_t decompressedSize = ZSTD_decompressDCtx(context, to_write, args->variable_args->to_download->objects[index].chunks.objects[j].uncompressed_size, ranges[j], args->variable_args->to_download->objects[index].chunks.objects[j].compressed_size);
-            if (decompressedSize != args->variable_args->to_download->objects[index].chunks.objects[j].uncompressed_size) {
-                eprintf("Error: ZSTD decompressed size doesn't match expected value! Expected %u, got %"PRId64"\n", args->variable_args->to_download->objects[index].chunks.objects[j].uncompressed_size, decompressedSize);
-                eprintf("failing chunk id: %016"PRIx64", failing bundle id: %016"PRIx64"\n", args->variable_args->to_download->objects[index].chunks.objects[j].chunk_id, args->variable_args->to_download->objects[index].chunks.objects[j].bundle_id);
+        // all chunks are done by now
+        queue_push(args->output, sink.current);
+        finish_job(args->jobs);
+        release_plan(plan);
+    }
+    if (!args->filesystem_only)
+        closesocket(args->ssl_structs.socket);
+
+    return _args;
+}
+
+void* decompress_chunks(void* _args)
+{
+    struct stage_args* args = _args;
+    ZSTD_DCtx* context = ZSTD_createDCtx();
+    struct fetched_chunks* fetched;
+    while ( (fetched = queue_pop(args->input)) ) {
+        struct download_plan* plan = fetched->plan;
+        struct chunk_writes* writes = NULL;
+        for (uint32_t i = 0; i < fetched->chunks.length; i++) {
+            Chunk* chunk = &fetched->chunks.objects[i];
+#ifndef _WIN32
+            if (plan->mmap_output && chunk_mappable(plan, chunk)) {
+                decompress_to_mappings(plan, context, chunk, fetched->ranges[i]);
+                continue;
+            }
+#endif
+            if (!writes) {
+                writes = get_chunk_writes(args->write_pool, plan);
+            } else if (writes->used + chunk->uncompressed_size > args->write_pool->buffer_size) {
+                queue_push(args->output, writes);
+                writes = get_chunk_writes(args->write_pool, plan);
+            }
+            // straight from the received data into the buffer the writes are done from
+            uint8_t* to_write = &writes->buffer[writes->used];
+            decompress_chunk(context, chunk, to_write, fetched->ranges[i]);
+            if (args->sparse && all_zeroes(to_write, chunk->uncompressed_size)) {
+                // nothing to keep in the buffer, the writes only punch holes
+                add_chunk_writes(plan, &writes->batch, chunk, NULL);
+                continue;
+            }
+            add_chunk_writes(plan, &writes->batch, chunk, to_write);
+            writes->used += chunk->uncompressed_size;
+        }
+        // chunks of a bundle are mostly stored in file order, so this mostly turns whole runs into single writes
+        if (writes)
+            queue_push(args->output, writes);
+#ifndef _WIN32
+        if (fetched->mapping)
+            release_bundle(plan->bundle_cache, fetched->mapping);
+#endif
+        return_pooled_item(args->input_pool, fetched);
+        release_plan(plan);
+    }
+    ZSTD_freeDCtx(context);
+
+    return _args;
+}
+
+void* write_chunks(void* _args)
+{
+    struct stage_args* args = _args;
+    FileWriter writer;
+    initialize_file_writer(&writer, args->io_uring);
+    struct chunk_writes* writes;
+    while ( (writes = queue_pop(args->input)) ) {
+        struct download_plan* plan = writes->plan;
+        flush_writes(plan, &writes->batch, &writer);
+        return_pooled_item(args->write_pool, writes);
+        release_plan(plan);
+    }
+    free_file_writer(&writer);
+
+    return _args;
+}
+
+// Makes sure all bundles any of files may need exist on disk and hold all their chunks, so that a missing one is
+// reported (along with all others) before anything is read, rather than by exiting halfway through. Which chunks are
+// needed is only known once existing files are verified, so this checks for all of them.
+static void check_bundles(const FileList* files)
+{
+    HashIndex bundle_index; // bundle_id -> index into bundles
+    initialize_hash_index(&bundle_index, 0);
+    LIST(struct bundle_extent) bundles;
+    initialize_list(&bundles);
+    for (uint32_t i = 0; i < files->length; i++) {
+        const ChunkList* chunks = &files->objects[i].chunks;
+        for (uint32_t j = 0; j < chunks->length; j++) {
+            const Chunk* chunk = &chunks->objects[j];
+            uint64_t end = (uint64_t) chunk->bundle_offset + chunk->compressed_size;
+            if (hash_index_insert(&bundle_index, chunk->bundle_id, bundles.length)) {
+                add_object(&bundles, (&(struct bundle_extent) {.bundle_id = chunk->bundle_id, .end = end}));
+            } else {
+                struct bundle_extent* bundle = &bundles.objects[hash_index_find(&bundle_index, chunk->bundle_id)];
+                bundle->end = max(bundle->end, end);
+            }
+        }
+    }
+    free_hash_index(&bundle_index);
+
+    size_t bundle_base_length = strlen(bundle_base);
+    char bundle_path[bundle_base_length + 25];
+    memcpy(bundle_path, bundle_base, bundle_base_length);
+    uint32_t missing_count = 0;
+    for (uint32_t i = 0; i < bundles.length; i++) {
+        sprintf(bundle_path + bundle_base_length, "/%016"PRIX64".bundle", bundles.objects[i].bundle_id);
+        struct stat bundle_info;
+        if (stat(bundle_path, &bundle_info) == -1) {
+            eprintf("Error: Bundle \"%s\" is missing.\n", bundle_path);
+            missing_count++;
+        } else if ((uint64_t) bundle_info.st_size < bundles.objects[i].end) {
+            eprintf("Error: Bundle \"%s\" is too small for its chunks.\n", bundle_path);
+            missing_count++;
+        }
+    }
+    if (missing_count > 0) {
+        eprintf("%u of %u bundles can't be read. Make sure all required bundles exist and are accessable at \"%s\".\n", missing_count, bundles.length, bundle_base);
+        exit(EXIT_FAILURE);
+    }
+    free(bundles.objects);
+}
+
+void* verify_chunks(void* _args)
+{
+    struct verify_args* args = _args;
+    IoEngine io;
+    initialize_io_engine(&io, false);
+    uint8_t* buffer = NULL;
+    size_t buffer_size = 0;
+#ifndef _WIN32
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+#endif
+    Job job;
+    while (take_job(args->jobs, args->worker, &job)) {
+        struct verified_file* verified = &args->files[job.index];
+        if (args->verify_only && atomic_load(&verified->failed)) {
+            finish_job(args->jobs);
+            continue;
+        }
+        // split off everything past JOB_SIZE bytes, so that idle workers can take over the rest of a big file
+        const Chunk* chunks = &verified->file->chunks.objects[job.start];
+        uint32_t chunk_count = 1;
+        uint64_t start = chunks[0].file_offset;
+        uint64_t end = chunks[0].file_offset + chunks[0].uncompressed_size;
+        while (chunk_count < job.count && end - start + chunks[chunk_count].uncompressed_size <= JOB_SIZE) {
+            start = min(start, chunks[chunk_count].file_offset);
+            end = max(end, chunks[chunk_count].file_offset + chunks[chunk_count].uncompressed_size);
+            chunk_count++;
+        }
+        if (chunk_count < job.count)
+            push_job(args->jobs, args->worker, (Job) {job.index, job.start + chunk_count, job.count - chunk_count, 0});
+
+        // chunks past the end of the file are invalid without reading anything
+        end = min(end, verified->size);
+        const uint8_t* data = NULL;
+#ifndef _WIN32
+        void* mapping = MAP_FAILED;
+        uint64_t map_start = start & ~(page_size - 1);
+#endif
+        if (end > start) {
+            int fd = open(verified->path, O_RDONLY | O_BINARY);
+            bool failed = fd == -1;
+            if (!failed && end - start < VERIFY_MAP_SIZE) {
+                if (end - start > buffer_size) {
+                    buffer_size = end - start;
+                    buffer = realloc(buffer, buffer_size);
+                }
+                add_io_request(&io, fd, start);
+                add_io_vector(&io, buffer, end - start);
+                failed = !run_io(&io, false);
+                data = buffer;
+            }
+#ifndef _WIN32
+            else if (!failed) {
+                mapping = mmap(NULL, end - map_start, PROT_READ, MAP_SHARED, fd, map_start);
+                failed = mapping == MAP_FAILED;
+                if (!failed) {
+                    // the whole range is read ahead right away rather than page by page as it's hashed, and the
+                    // one after it while this one is hashed, most likely by this worker too
+                    madvise(mapping, end - map_start, MADV_WILLNEED);
+                    if (chunk_count < job.count)
+                        posix_fadvise(fd, end, JOB_SIZE, POSIX_FADV_WILLNEED);
+                    data = (uint8_t*) mapping + (start - map_start);
+                }
+            }
+#endif
+            if (fd != -1)
+                close(fd);
+            if (failed) {
+                eprintf("Error: Failed to read \"%s\"\n", verified->path);
                 exit(EXIT_FAILURE);
             }
+        }
+        bool failed = false;
+        for (uint32_t i = 0; i < chunk_count; i++) {
+            const Chunk* chunk = &chunks[i];
+            bool valid = chunk->file_offset + chunk->uncompressed_size <= end;
+            if (valid) {
+                BinaryData chunk_data = {.data = (uint8_t*) data + (chunk->file_offset - start), .length = chunk->uncompressed_size};
+                valid = chunk_valid(&chunk_data, chunk->chunk_id, chunk->hashType);
+            }
+            verified->valid_chunks[job.start + i] = valid;
+            failed |= !valid;
+        }
+        if (failed)
+            atomic_store(&verified->failed, true);
+#ifndef _WIN32
+        if (mapping != MAP_FAILED)
+            munmap(mapping, end - map_start);
+#endif
+        finish_job(args->jobs);
+    }
+    free(buffer);
+    free_io_engine(&io);
+
+    return _args;
+}
+
+// checks all chunks of files on up to amount_of_threads threads, every file starting out as one job
+static void verify_files(struct verified_file* files, uint32_t file_count, bool verify_only)
+{
+    uint32_t chunk_count = 0;
+    uint64_t total_size = 0;
+    for (uint32_t i = 0; i < file_count; i++) {
+        chunk_count += files[i].file->chunks.length;
+        total_size += files[i].file->file_size;
+    }
+    // a single big file keeps all threads busy too, once it's split up
+    int thread_count = min((uint32_t) amount_of_threads, chunk_count);
+    if (thread_count == 0)
+        return;
+    JobSystem jobs;
+    initialize_job_system(&jobs, thread_count);
+    for (uint32_t i = 0; i < file_count; i++) {
+        // with verify_only, a file of the wrong size is known to be incorrect already
+        if (files[i].file->chunks.length != 0 && !atomic_load(&files[i].failed))
+            push_job(&jobs, i % thread_count, (Job) {i, 0, files[i].file->chunks.length, 0});
+    }
+    v_printf(1, "Info: Verifying %u files (%"PRIu64" MiB) on %d thread%s.\n", file_count, total_size >> 20, thread_count, thread_count == 1 ? "" : "s");
+    pthread_t tid[thread_count];
+    struct verify_args thread_args[thread_count];
+    for (int i = 0; i < thread_count; i++) {
+        thread_args[i] = (struct verify_args) {.files = files, .jobs = &jobs, .worker = i, .verify_only = verify_only};
+        pthread_create(&tid[i], NULL, verify_chunks, &thread_args[i]);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    v_printf(1, "Info: Ran %"PRIu64" verification jobs, %"PRIu64" of them stolen.\n", (uint64_t) atomic_load(&jobs.pushed_jobs), (uint64_t) atomic_load(&jobs.stolen_jobs));
+    free_job_system(&jobs);
+}
+
+// how full queue was on average and how often its producers or consumers had to wait
+static void print_queue_stats(const char* name, BoundedQueue* queue)
+{
+    uint64_t pushes = atomic_load(&queue->pushes);
+    v_printf(1, "Info: %s queue held %.1f of %zu items on average; %"PRIu64" pushes waited for space, %"PRIu64" pops for items.\n",
+        name, pushes ? (double) atomic_load(&queue->occupancy_sum) / pushes : 0., queue->mask + 1,
+        (uint64_t) atomic_load(&queue->full_waits), (uint64_t) atomic_load(&queue->empty_waits));
+}
+
+// share of the time thread_count threads spent not waiting on queues
+static double busy_share(int thread_count, uint64_t elapsed, uint64_t waited)
+{
+    if (thread_count == 0 || elapsed == 0)
+        return 0.;
+    return 100. * max(1. - (double) waited / ((double) thread_count * elapsed), 0.);
+}
+
+// Builds the unique chunk table of plan from the chunks every output file still needs (needed_chunks[i] for output
+// file i). Chunks that earlier plans of pipeline fetched already become copies instead.
+static void build_download_plan(struct download_pipeline* pipeline, struct download_plan* plan, ChunkList* needed_chunks)
+{
+    uint32_t needed_count = 0;
+    for (uint32_t i = 0; i < plan->output_files.length; i++) {
+        needed_count += needed_chunks[i].length;
+    }
+    initialize_list_size(&plan->unique_chunks, max(needed_count, (uint32_t) 1));
+    initialize_hash_index(&plan->chunk_index, needed_count);
+    uint32_t* destination_counts = calloc(max(needed_count, (uint32_t) 1) + 1, sizeof(uint32_t));
+    uint32_t destination_count = 0;
+    uint32_t copy_count = 0;
+    uint64_t copied_bytes = 0;
+    for (uint32_t i = 0; i < plan->output_files.length; i++) {
+        struct output_file* output_file = &plan->output_files.objects[i];
+        uint32_t pending_writes = 0;
+        for (uint32_t j = 0; j < needed_chunks[i].length; j++) {
+            Chunk* chunk = &needed_chunks[i].objects[j];
+            uint32_t source = hash_index_find(&pipeline->fetched_chunks, chunk->chunk_id);
+            if (source != HASH_INDEX_EMPTY) {
+                add_object(&pipeline->chunk_copies, (&(struct chunk_copy) {
+                    .source = source,
+                    .path_index = output_file->path_index,
+                    .file_offset = chunk->file_offset,
+                    .size = chunk->uncompressed_size
+                }));
+                copy_count++;
+                copied_bytes += chunk->compressed_size;
+                continue;
+            }
+            if (hash_index_insert(&plan->chunk_index, chunk->chunk_id, plan->unique_chunks.length))
+                add_object(&plan->unique_chunks, chunk);
+            destination_counts[hash_index_find(&plan->chunk_index, chunk->chunk_id)]++;
+            pending_writes++;
+        }
+        destination_count += pending_writes;
+        output_file->fd = -1;
+        output_file->direct_fd = -1;
+        output_file->direct_refused = false;
+        output_file->retired_direct_fd = -1;
+        output_file->users = 0;
+        output_file->older = output_file->newer = NULL;
+        atomic_init(&output_file->mapping, NULL);
+        atomic_init(&output_file->pending_writes, pending_writes);
+    }
 
-            flockfile(args->variable_args->output_file);
-            fseeko(args->variable_args->output_file, args->variable_args->to_download->objects[index].chunks.objects[j].file_offset, SEEK_SET);
-            fwrite(to_write, args->variable_args->to_download->objects[index].chunks.objects[j].uncompressed_size, 1, args->variable_args->output_file);
-            funlockfile(args->variable_args->output_file);
-            free(to_write);
-            free(ranges[j]);
+    // destinations are grouped by unique chunk, in the order of the output files
+    plan->destination_starts = malloc((plan->unique_chunks.length + 1) * sizeof(uint32_t));
+    plan->destination_starts[0] = 0;
+    for (uint32_t i = 0; i < plan->unique_chunks.length; i++) {
+        plan->destination_starts[i + 1] = plan->destination_starts[i] + destination_counts[i];
+        destination_counts[i] = plan->destination_starts[i];
+    }
+    plan->destinations = malloc(max(destination_count, (uint32_t) 1) * sizeof(struct chunk_destination));
+    for (uint32_t i = 0; i < plan->output_files.length; i++) {
+        for (uint32_t j = 0; j < needed_chunks[i].length; j++) {
+            uint32_t unique_index = hash_index_find(&plan->chunk_index, needed_chunks[i].objects[j].chunk_id);
+            // copies never made it into chunk_index
+            if (unique_index == HASH_INDEX_EMPTY)
+                continue;
+            plan->destinations[destination_counts[unique_index]++] = (struct chunk_destination) {
+                .output_index = i,
+                .file_offset = needed_chunks[i].objects[j].file_offset
+            };
         }
-        free(ranges);
     }
-    if (!args->filesystem_only)
-        closesocket(args->ssl_structs.socket);
-    ZSTD_freeDCtx(context);
+    free(destination_counts);
+
+    // later plans copy these from their first destination
+    for (uint32_t i = 0; i < plan->unique_chunks.length; i++) {
+        const struct chunk_destination* first = &plan->destinations[plan->destination_starts[i]];
+        hash_index_insert(&pipeline->fetched_chunks, plan->unique_chunks.objects[i].chunk_id, pipeline->chunk_sources.length);
+        add_object(&pipeline->chunk_sources, (&(struct chunk_location) {
+            .path_index = plan->output_files.objects[first->output_index].path_index,
+            .file_offset = first->file_offset
+        }));
+    }
+
+    if (plan->unique_chunks.length != destination_count) {
+        uint64_t saved_bytes = 0;
+        for (uint32_t i = 0; i < plan->unique_chunks.length; i++) {
+            uint32_t extra_destinations = plan->destination_starts[i + 1] - plan->destination_starts[i] - 1;
+            saved_bytes += (uint64_t) extra_destinations * plan->unique_chunks.objects[i].compressed_size;
+        }
+        v_printf(1, "Info: %u chunk writes are served by %u unique chunks, saving %"PRIu64" bytes of downloads.\n", destination_count, plan->unique_chunks.length, saved_bytes);
+    }
+    if (copy_count != 0)
+        v_printf(1, "Info: %u chunk writes are copied from files of earlier batches, saving %"PRIu64" bytes of downloads.\n", copy_count, copied_bytes);
+}
+
+// Checks the existing files among to_download in batches of about VERIFY_BATCH_SIZE bytes, each on all threads, and
+// hands every batch on to the download as soon as it's done, so that verifying the next files and downloading the
+// repairs of the previous ones overlap.
+void* verify_ahead(void* _args)
+{
+    struct verify_ahead_args* args = _args;
+    struct download_args* download_args = args->download_args;
+    FileList* files = download_args->to_download;
+    for (uint32_t i = 0; i < files->length;) {
+        struct verify_batch* batch = malloc(sizeof(struct verify_batch));
+        batch->start = i;
+        initialize_list(&batch->files);
+        // only bytes that are actually read count, missing files and ones that are skipped are free
+        uint64_t batch_size = 0;
+        for (; i < files->length && batch_size < VERIFY_BATCH_SIZE; i++) {
+            const File* file = &files->objects[i];
+            if (download_args->patch)
+                continue;
+            char* path = malloc(strlen(download_args->output_path) + strlen(file->name) + 2);
+            sprintf(path, "%s/%s", download_args->output_path, file->name);
+            struct stat file_info;
+            if (stat(path, &file_info) == -1 || (download_args->skip_existing && file_info.st_size == (off_t) file->file_size)) {
+                free(path);
+                continue;
+            }
+            add_object(&batch->files, (&(struct verified_file) {
+                .file_index = i,
+                .file = file,
+                .path = path,
+                .size = file_info.st_size,
+                .valid_chunks = calloc(max(file->chunks.length, (uint32_t) 1), sizeof(bool))
+            }));
+            atomic_init(&batch->files.objects[batch->files.length - 1].failed, download_args->verify_only && (uint64_t) file_info.st_size != file->file_size);
+            batch_size += min((uint64_t) file_info.st_size, file->file_size);
+        }
+        batch->end = i;
+        verify_files(batch->files.objects, batch->files.length, download_args->verify_only);
+        queue_push(args->output, batch);
+    }
+    queue_push(args->output, NULL);
 
     return _args;
 }
 
+// Starts the threads of pipeline, with thread_count download threads that each open their connection once. The
+// buffers are sized for the chunks of all files, so that they fit every plan added later on.
+static void start_pipeline(struct download_pipeline* pipeline, HostPort* host_port, int thread_count)
+{
+    struct download_args* args = pipeline->args;
+    // every plan has at least one file of to_download
+    pipeline->plans = malloc(max(args->to_download->length, (uint32_t) 1) * sizeof(struct download_plan*));
+    pipeline->plan_count = 0;
+    pipeline->thread_count = thread_count;
+    initialize_job_system(&pipeline->jobs, thread_count);
+    // download threads keep waiting for the jobs of later plans until finish_pipeline
+    hold_jobs(&pipeline->jobs);
+    pipeline->decompress_count = args->decompress_threads ? args->decompress_threads : amount_of_threads;
+    pipeline->write_count = args->write_threads ? args->write_threads : 1;
+    v_printf(1, "Info: Fetching on %d thread%s.\n", thread_count, thread_count == 1 ? "" : "s");
+    if (args->mmap_output) {
+        v_printf(1, "Info: Decompressing into mapped files on %d thread%s.\n", pipeline->decompress_count, pipeline->decompress_count == 1 ? "" : "s");
+    } else {
+        v_printf(1, "Info: Decompressing on %d thread%s, writing on %d thread%s.\n", pipeline->decompress_count, pipeline->decompress_count == 1 ? "" : "s", pipeline->write_count, pipeline->write_count == 1 ? "" : "s");
+    }
+    uint32_t max_chunk_size = 0;
+    uint32_t max_compressed_size = 0;
+    for (uint32_t i = 0; i < args->to_download->length; i++) {
+        const ChunkList* chunks = &args->to_download->objects[i].chunks;
+        for (uint32_t j = 0; j < chunks->length; j++) {
+            max_chunk_size = max(max_chunk_size, chunks->objects[j].uncompressed_size);
+            max_compressed_size = max(max_compressed_size, chunks->objects[j].compressed_size);
+        }
+    }
+    // twice the consumers, so that they always find something to take while the producers catch up
+    initialize_bounded_queue(&pipeline->fetched_queue, 2 * pipeline->decompress_count);
+    initialize_bounded_queue(&pipeline->write_queue, 2 * pipeline->write_count);
+    // enough items for every queue slot and every thread to hold one, allocated on first use and reused from then on;
+    // a download thread holds two fetched_chunks while a read window (at most one buffer in size) crosses into the next
+    initialize_item_pool(&pipeline->fetch_pool, pipeline->map_bundles ? 0 : max((size_t) FETCH_BATCH_SIZE, (size_t) max_compressed_size), pipeline->fetched_queue.mask + 1 + 2 * thread_count + pipeline->decompress_count);
+    initialize_item_pool(&pipeline->write_pool, max((size_t) WRITE_BATCH_SIZE, (size_t) max_chunk_size), pipeline->write_queue.mask + 1 + pipeline->write_count + pipeline->decompress_count);
+#ifdef MALLOC_STATS
+    pipeline->start_allocations = allocation_count();
+#endif
+    pipeline->start_time = nanoseconds();
+
+    pipeline->write_tids = malloc(pipeline->write_count * sizeof(pthread_t));
+    pipeline->write_args = (struct stage_args) {.input = &pipeline->write_queue, .write_pool = &pipeline->write_pool, .io_uring = args->io_uring};
+    for (int i = 0; i < pipeline->write_count; i++) {
+        pthread_create(&pipeline->write_tids[i], NULL, write_chunks, &pipeline->write_args);
+    }
+    pipeline->decompress_tids = malloc(pipeline->decompress_count * sizeof(pthread_t));
+    pipeline->decompress_args = (struct stage_args) {.input = &pipeline->fetched_queue, .output = &pipeline->write_queue, .input_pool = &pipeline->fetch_pool, .write_pool = &pipeline->write_pool, .sparse = args->sparse};
+    for (int i = 0; i < pipeline->decompress_count; i++) {
+        pthread_create(&pipeline->decompress_tids[i], NULL, decompress_chunks, &pipeline->decompress_args);
+    }
+    pipeline->fetch_tids = malloc(thread_count * sizeof(pthread_t));
+    pipeline->fetch_args = malloc(thread_count * sizeof(struct bundle_args));
+    for (int i = 0; i < thread_count; i++) {
+        struct bundle_args* new_bundle_args = &pipeline->fetch_args[i];
+        if (!pipeline->filesystem_only) {
+            new_bundle_args->ssl_structs.socket = open_connection_s(host_port->host, host_port->port);
+            new_bundle_args->ssl_structs.host_port = host_port;
+            if (pipeline->is_ssl) {
+                br_ssl_client_init_full(&new_bundle_args->ssl_structs.ssl_client_context, &new_bundle_args->ssl_structs.x509_client_context, TAs, TAs_NUM);
+                new_bundle_args->ssl_structs.io_buffer = malloc(BR_SSL_BUFSIZE_BIDI);
+                br_ssl_engine_set_buffer(&new_bundle_args->ssl_structs.ssl_client_context.eng, new_bundle_args->ssl_structs.io_buffer, BR_SSL_BUFSIZE_BIDI, 1);
+                br_ssl_client_reset(&new_bundle_args->ssl_structs.ssl_client_context, host_port->host, 0);
+                br_sslio_init(&new_bundle_args->ssl_structs.ssl_io_context, &new_bundle_args->ssl_structs.ssl_client_context.eng, recv_wrapper, &new_bundle_args->ssl_structs.socket, send_wrapper, &new_bundle_args->ssl_structs.socket);
+            }
+        }
+        if (pipeline->filesystem_only)
+            initialize_io_engine(&new_bundle_args->io, args->io_uring);
+        new_bundle_args->filesystem_only = pipeline->filesystem_only;
+        new_bundle_args->plans = pipeline->plans;
+        new_bundle_args->jobs = &pipeline->jobs;
+        new_bundle_args->worker = i;
+        new_bundle_args->output = &pipeline->fetched_queue;
+        new_bundle_args->fetch_pool = &pipeline->fetch_pool;
+        pthread_create(&pipeline->fetch_tids[i], NULL, fetch_chunks, new_bundle_args);
+    }
+}
+
+// Hands the chunks of plan to the running pipeline: the needed chunks of all its files are grouped by bundle once,
+// and every bundle starts out as one job, which workers split into JOB_SIZE pieces as they go. The reference
+// download_files held on plan passes on to its jobs.
+static void add_plan(struct download_pipeline* pipeline, struct download_plan* plan)
+{
+    plan->list = pipeline->plan_count++;
+    // written before any of its jobs is pushed, which is what makes it visible to the workers
+    pipeline->plans[plan->list] = plan;
+    for (uint32_t i = 0; i < plan->bundles->length; i++) {
+        retain_plan(plan);
+        push_job(&pipeline->jobs, i % pipeline->thread_count, (Job) {i, 0, plan->bundles->objects[i].chunks.length, plan->list});
+    }
+    release_plan(plan);
+}
+
+// waits for all plans added to pipeline to be downloaded and written, then stops its threads
+static void finish_pipeline(struct download_pipeline* pipeline)
+{
+    // releases the hold of start_pipeline, so the download threads stop once they're out of jobs
+    finish_job(&pipeline->jobs);
+    // every stage is stopped once the one before it is done, with one NULL item per thread
+    for (int i = 0; i < pipeline->thread_count; i++) {
+        pthread_join(pipeline->fetch_tids[i], NULL);
+        if (!pipeline->filesystem_only && pipeline->is_ssl)
+            free(pipeline->fetch_args[i].ssl_structs.io_buffer);
+        if (pipeline->filesystem_only)
+            free_io_engine(&pipeline->fetch_args[i].io);
+    }
+    uint64_t fetch_time = nanoseconds() - pipeline->start_time;
+    for (int i = 0; i < pipeline->decompress_count; i++) {
+        queue_push(&pipeline->fetched_queue, NULL);
+    }
+    for (int i = 0; i < pipeline->decompress_count; i++) {
+        pthread_join(pipeline->decompress_tids[i], NULL);
+    }
+    uint64_t decompress_time = nanoseconds() - pipeline->start_time;
+    for (int i = 0; i < pipeline->write_count; i++) {
+        queue_push(&pipeline->write_queue, NULL);
+    }
+    for (int i = 0; i < pipeline->write_count; i++) {
+        pthread_join(pipeline->write_tids[i], NULL);
+    }
+    uint64_t write_time = nanoseconds() - pipeline->start_time;
+#ifdef MALLOC_STATS
+    v_printf(1, "Info: %"PRIu64" allocations while downloading, %u + %u buffers pooled.\n", allocation_count() - pipeline->start_allocations, (uint32_t) atomic_load(&pipeline->fetch_pool.allocated), (uint32_t) atomic_load(&pipeline->write_pool.allocated));
+#endif
+
+    v_printf(1, "Info: Ran %"PRIu64" jobs for %u batch%s, %"PRIu64" of them stolen.\n", (uint64_t) atomic_load(&pipeline->jobs.pushed_jobs), pipeline->plan_count, pipeline->plan_count == 1 ? "" : "es", (uint64_t) atomic_load(&pipeline->jobs.stolen_jobs));
+    v_printf(1, "Info: Wrote %"PRIu64" chunks with %"PRIu64" write calls.\n", (uint64_t) atomic_load(&pipeline->chunk_writes), (uint64_t) atomic_load(&pipeline->write_calls));
+    print_queue_stats("Decompression", &pipeline->fetched_queue);
+    print_queue_stats("Write", &pipeline->write_queue);
+    // a stage whose threads hardly ever wait is the one holding the others up
+    v_printf(1, "Info: Busy time of download threads %.0f%%, decompression threads %.0f%%, write threads %.0f%%.\n",
+        busy_share(pipeline->thread_count, fetch_time, atomic_load(&pipeline->fetched_queue.push_wait_ns)),
+        busy_share(pipeline->decompress_count, decompress_time, atomic_load(&pipeline->fetched_queue.pop_wait_ns) + atomic_load(&pipeline->write_queue.push_wait_ns)),
+        busy_share(pipeline->write_count, write_time, atomic_load(&pipeline->write_queue.pop_wait_ns)));
+    // all plans are freed by now, the last ones by the threads that finished them
+    if (pipeline->map_bundles)
+        v_printf(1, "Info: Mapped %u bundle files for %u bundles.\n", (uint32_t) atomic_load(&pipeline->bundle_mappings), (uint32_t) atomic_load(&pipeline->bundle_count));
+    free_item_pool(&pipeline->fetch_pool, free_fetched_chunks);
+    free_item_pool(&pipeline->write_pool, free_chunk_writes);
+    free_bounded_queue(&pipeline->fetched_queue);
+    free_bounded_queue(&pipeline->write_queue);
+    free_job_system(&pipeline->jobs);
+    free(pipeline->fetch_tids);
+    free(pipeline->fetch_args);
+    free(pipeline->decompress_tids);
+    free(pipeline->write_tids);
+    free(pipeline->plans);
+}
+
+// Copies the chunks later plans share with earlier ones from the files they were first written to, once everything
+// was written. They're read back through the page cache, which is cheaper than fetching and decompressing them again.
+static void copy_fetched_chunks(struct download_pipeline* pipeline)
+{
+    if (pipeline->chunk_copies.length == 0)
+        return;
+    IoEngine io;
+    initialize_io_engine(&io, false);
+    uint8_t* buffer = NULL;
+    uint32_t buffer_size = 0;
+    uint32_t source_path = UINT32_MAX, destination_path = UINT32_MAX;
+    int source_fd = -1, destination_fd = -1;
+    uint64_t copied_bytes = 0;
+    for (uint32_t i = 0; i < pipeline->chunk_copies.length; i++) {
+        const struct chunk_copy* copy = &pipeline->chunk_copies.objects[i];
+        const struct chunk_location* source = &pipeline->chunk_sources.objects[copy->source];
+        // copies are in the order of the files they go to, so both files mostly stay the same from one to the next
+        if (source->path_index != source_path) {
+            if (source_fd != -1)
+                close(source_fd);
+            source_path = source->path_index;
+            source_fd = open(pipeline->paths.objects[source_path], O_RDONLY | O_BINARY);
+            if (source_fd == -1) {
+                eprintf("Error: Failed to open \"%s\": %s\n", pipeline->paths.objects[source_path], strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (copy->path_index != destination_path) {
+            if (destination_fd != -1)
+                close(destination_fd);
+            destination_path = copy->path_index;
+            destination_fd = open(pipeline->paths.objects[destination_path], O_WRONLY | O_BINARY);
+            if (destination_fd == -1) {
+                eprintf("Error: Failed to open \"%s\": %s\n", pipeline->paths.objects[destination_path], strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (copy->size > buffer_size) {
+            buffer_size = copy->size;
+            buffer = realloc(buffer, buffer_size);
+        }
+        add_io_request(&io, source_fd, source->file_offset);
+        add_io_vector(&io, buffer, copy->size);
+        if (!run_io(&io, false) || !write_at(destination_fd, copy->file_offset, buffer, copy->size)) {
+            eprintf("Error: Failed to copy a chunk from \"%s\" to \"%s\": %s\n", pipeline->paths.objects[source_path], pipeline->paths.objects[destination_path], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        copied_bytes += copy->size;
+    }
+    close(source_fd);
+    close(destination_fd);
+    free(buffer);
+    free_io_engine(&io);
+    v_printf(1, "Info: Copied %u chunks (%"PRIu64" bytes) that earlier batches fetched already.\n", pipeline->chunk_copies.length, copied_bytes);
+}
+
 void download_files(struct download_args* args)
 {
     bool filesystem_only = access(bundle_base, F_OK) == 0;
     if (filesystem_only)
         v_printf(1, "Info: Assuming \"%s\" is a path on disk.\n", bundle_base);
     HostPort* host_port = get_host_port(bundle_base);
-    bool is_ssl = strcmp(host_port->port, "443") == 0;
-    char file_buffer[256*1024];
-
-    int pipe_to_downloader[2], pipe_from_downloader[2];
-    #ifdef _WIN32
-        assert(_pipe(pipe_to_downloader, sizeof(void*), O_BINARY) == 0);
-        assert(_pipe(pipe_from_downloader, 1, O_BINARY) == 0);
-    #else
-        assert(pipe(pipe_to_downloader) == 0);
-        assert(pipe(pipe_from_downloader) == 0);
-    #endif
-
-    pthread_t tid[amount_of_threads];
-    int threads_created = 0;
-    bool do_read = true;
-    int32_t file_index_finished = -1;
+    // Chunks of one file are spread over many bundles, so lots of output files can be in progress at the same time.
+    // They get up to a quarter of the descriptors (two each with direct i/o), the rest is left to bundles, sockets
+    // and the like; those running out closes output files early as well.
+    uint32_t max_open_files = 8192 / 4;
+#ifndef _WIN32
+    struct rlimit file_limit;
+    if (getrlimit(RLIMIT_NOFILE, &file_limit) == 0) {
+        if (file_limit.rlim_cur < file_limit.rlim_max) {
+            file_limit.rlim_cur = file_limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &file_limit);
+            getrlimit(RLIMIT_NOFILE, &file_limit);
+        }
+        max_open_files = max(min(file_limit.rlim_cur, (rlim_t) UINT32_MAX) / 4, (rlim_t) 4);
+    }
+#else
+    _setmaxstdio(8192);
+#endif
 
-    for (uint32_t i = 0; i < args->to_download->length; i++) {
-        File to_download = args->to_download->objects[i];
-        char* file_output_path = malloc(strlen(args->output_path) + strlen(to_download.name) + 2);
-        sprintf(file_output_path, "%s/%s", args->output_path, to_download.name);
-        struct stat file_info;
-        stat(file_output_path, &file_info);
-        ChunkList chunks_to_download;
-        bool fixup = false;
-        if (access(file_output_path, F_OK) == 0) {
-            if (args->skip_existing && file_info.st_size == (off_t) to_download.file_size) {
-                free(file_output_path);
-                v_printf(2, "Skipping file %s\n", to_download.name);
-                continue;
-            } else {
+    struct download_pipeline pipeline = {.args = args, .filesystem_only = filesystem_only, .is_ssl = strcmp(host_port->port, "443") == 0};
+#ifndef _WIN32
+    // with io_uring bundles are read into buffers like on windows, otherwise chunks are decompressed where they're mapped
+    pipeline.map_bundles = filesystem_only && !args->io_uring;
+#endif
+    pthread_mutex_init(&pipeline.open_files.lock, NULL);
+    pipeline.open_files.oldest = pipeline.open_files.newest = NULL;
+    pipeline.open_files.count = 0;
+    pipeline.open_files.max_count = max_open_files;
+    atomic_init(&pipeline.chunk_writes, 0);
+    atomic_init(&pipeline.write_calls, 0);
+    atomic_init(&pipeline.bundle_mappings, 0);
+    atomic_init(&pipeline.bundle_count, 0);
+    initialize_hash_index(&pipeline.fetched_chunks, 0);
+    initialize_list(&pipeline.chunk_sources);
+    initialize_list(&pipeline.chunk_copies);
+    initialize_list(&pipeline.paths);
+
+    // once, before any batch is written
+    if (filesystem_only && !args->verify_only)
+        check_bundles(args->to_download);
+
+    BoundedQueue verified_batches;
+    initialize_bounded_queue(&verified_batches, 1);
+    pthread_t verify_tid;
+    struct verify_ahead_args verify_args = {.download_args = args, .output = &verified_batches};
+    pthread_create(&verify_tid, NULL, verify_ahead, &verify_args);
+
+    // every batch gets its own plan, which joins the download as soon as the batch is verified; chunks needed by
+    // several files are only downloaded once, within a batch and across them
+    struct verify_batch* batch;
+    while ( (batch = queue_pop(&verified_batches)) ) {
+        struct download_plan* plan = malloc(sizeof(struct download_plan));
+        plan->pipeline = &pipeline;
+        initialize_list(&plan->output_files);
+        plan->bundles = NULL;
+        plan->bundle_cache = NULL;
+        plan->direct_io = args->direct_io;
+#ifndef _WIN32
+        plan->mmap_output = args->mmap_output;
+#else
+        plan->mmap_output = false;
+#endif
+        atomic_init(&plan->references, 1);
+        LIST(ChunkList) needed_chunks;
+        initialize_list(&needed_chunks);
+
+        uint32_t next_verified = 0;
+        for (uint32_t i = batch->start; i < batch->end; i++) {
+            File to_download = args->to_download->objects[i];
+            char* file_output_path = malloc(strlen(args->output_path) + strlen(to_download.name) + 2);
+            sprintf(file_output_path, "%s/%s", args->output_path, to_download.name);
+            struct stat file_info;
+            stat(file_output_path, &file_info);
+            ChunkList chunks_to_download;
+            bool fixup = false;
+            bool preallocated;
+            if (args->patch) {
                 fixup = true;
-                flockfile(stdout);
-                printf("Verifying file %s...", to_download.name);
-                fflush(stdout);
-                initialize_list(&chunks_to_download);
-                if (args->verify_only && file_info.st_size != (off_t) to_download.file_size) {
-                    goto verify_failed;
-                }
-                FILE* input_file = fopen(file_output_path, "rb+");
-                if (!input_file) {
-                    eprintf("Error: Failed to open \"%s\"\n", file_output_path);
-                    exit(EXIT_FAILURE);
-                }
-                setvbuf(input_file, file_buffer, _IOFBF, 256 * 1024); // notably boosts performance when fully reading large files in my testing
-                for (uint32_t i = 0; i < to_download.chunks.length; i++) {
-                    if (file_info.st_size < (off_t) to_download.chunks.objects[i].file_offset + to_download.chunks.objects[i].uncompressed_size) {
-                        if (args->verify_only) {
-                            fclose(input_file);
-                            goto verify_failed;
-                        }
-                        add_objects(&chunks_to_download, &to_download.chunks.objects[i], to_download.chunks.length - i);
-                        break;
-                    } else {
-                        BinaryData current_chunk = {
-                            .length = to_download.chunks.objects[i].uncompressed_size,
-                            .data = malloc(to_download.chunks.objects[i].uncompressed_size)
-                        };
-                        assert(fread(current_chunk.data, 1, to_download.chunks.objects[i].uncompressed_size, input_file) == to_download.chunks.objects[i].uncompressed_size);
-                        if (!chunk_valid(&current_chunk, to_download.chunks.objects[i].chunk_id, to_download.chunks.objects[i].hashType)) {
-                            if (args->verify_only) {
-                                fclose(input_file);
-                                free(current_chunk.data);
-                                goto verify_failed;
-                            } else {
-                                add_object(&chunks_to_download, &to_download.chunks.objects[i]);
-                            }
-                        }
-                        free(current_chunk.data);
-                    }
-                }
-                fclose(input_file);
-                if (chunks_to_download.length == 0 && file_info.st_size == (off_t) to_download.file_size) {
-                    printf("\rFile %s is correct. \n", to_download.name);
+                initialize_list_size(&chunks_to_download, max(to_download.chunks.length, (uint32_t) 1));
+                add_objects(&chunks_to_download, to_download.chunks.objects, to_download.chunks.length);
+            } else if (access(file_output_path, F_OK) == 0) {
+                if (args->skip_existing && file_info.st_size == (off_t) to_download.file_size) {
                     free(file_output_path);
-                    free(chunks_to_download.objects);
-                    funlockfile(stdout);
+                    v_printf(2, "Skipping file %s\n", to_download.name);
                     continue;
-                } else verify_failed: {
-                    printf("\rFile %s is incorrect.\n", to_download.name);
-                    funlockfile(stdout);
+                } else {
+                    struct verified_file* verified = &batch->files.objects[next_verified++];
+                    assert(verified->file_index == i);
+                    fixup = true;
+                    initialize_list(&chunks_to_download);
+                    // with verify_only, nothing is checked past the first invalid chunk, so there's no list to make
+                    for (uint32_t j = 0; j < to_download.chunks.length && !args->verify_only; j++) {
+                        if (!verified->valid_chunks[j])
+                            add_object(&chunks_to_download, &to_download.chunks.objects[j]);
+                    }
+                    if (!atomic_load(&verified->failed) && file_info.st_size == (off_t) to_download.file_size) {
+                        printf("File %s is correct.\n", to_download.name);
+                        free(file_output_path);
+                        free(chunks_to_download.objects);
+                        continue;
+                    }
+                    printf("File %s is incorrect.\n", to_download.name);
                     if (args->verify_only) {
                         free(file_output_path);
                         free(chunks_to_download.objects);
                         continue;
                     }
                 }
-            }
-        } else if (args->existing_only) {
-            free(file_output_path);
-            continue;
-        } else if (args->verify_only) {
-            printf("File %s is missing.\n", to_download.name);
-            free(file_output_path);
-            continue;
-        }
-
-        if (threads_created == amount_of_threads && do_read) {
-            assert(read(pipe_from_downloader[0], &(uint8_t) {0}, 1) == 1);
-            do_read = false;
-        }
-        FILE* output_file;
-        if (fixup) {
-            printf("Fixing up file %s...\n", to_download.name);
-            if (chunks_to_download.length == 0) {
-                free(chunks_to_download.objects);
-                assert(truncate(file_output_path, to_download.file_size) == 0);
+            } else if (args->existing_only) {
                 free(file_output_path);
                 continue;
-            } else {
-                output_file = fopen(file_output_path, "rb+");
-            }
-        } else {
-            printf("%s file %s...\n", filesystem_only ? "Processing" : "Downloading", to_download.name);
-            create_dirs(file_output_path, false);
-            output_file = fopen(file_output_path, "wb");
-        }
-        v_printf(2, "Downloading to %s\n", file_output_path);
-        assert(output_file);
-        free(file_output_path);
-        assert(ftruncate(fileno(output_file), to_download.file_size + 1) == 0);
-        BundleList* unique_bundles = group_by_bundles(fixup ? &chunks_to_download : &to_download.chunks);
-        if (fixup) {
-            free(chunks_to_download.objects);
-        }
-        uint32_t* index = malloc(sizeof(uint32_t));
-        *index = 0;
-        int* threads_visited = malloc(sizeof(int));
-        *threads_visited = 0;
-        pthread_mutex_t* index_lock = malloc(sizeof(pthread_mutex_t));
-        pthread_mutex_init(index_lock, NULL);
-
-        uint32_t current_index = 0;
-        if (threads_created < amount_of_threads) {
-            pthread_mutex_lock(index_lock);
-            while (threads_created < amount_of_threads && current_index < unique_bundles->length) {
-                struct bundle_args* new_bundle_args = malloc(sizeof(struct bundle_args));
-                if (!filesystem_only) {
-                    new_bundle_args->ssl_structs.socket = open_connection_s(host_port->host, host_port->port);
-                    new_bundle_args->ssl_structs.host_port = host_port;
-                    if (is_ssl) {
-                        br_ssl_client_init_full(&new_bundle_args->ssl_structs.ssl_client_context, &new_bundle_args->ssl_structs.x509_client_context, TAs, TAs_NUM);
-                        new_bundle_args->ssl_structs.io_buffer = malloc(BR_SSL_BUFSIZE_BIDI);
-                        br_ssl_engine_set_buffer(&new_bundle_args->ssl_structs.ssl_client_context.eng, new_bundle_args->ssl_structs.io_buffer, BR_SSL_BUFSIZE_BIDI, 1);
-                        br_ssl_client_reset(&new_bundle_args->ssl_structs.ssl_client_context, host_port->host, 0);
-                        br_sslio_init(&new_bundle_args->ssl_structs.ssl_io_context, &new_bundle_args->ssl_structs.ssl_client_context.eng, recv_wrapper, &new_bundle_args->ssl_structs.socket, send_wrapper, &new_bundle_args->ssl_structs.socket);
-                    }
-                }
-                new_bundle_args->filesystem_only = filesystem_only;
-                new_bundle_args->coordinate_pipes[0] = pipe_to_downloader[0];
-                new_bundle_args->coordinate_pipes[1] = pipe_from_downloader[1];
-                new_bundle_args->file_index_finished = &file_index_finished;
-                struct variable_bundle_args* new_variable_args = malloc(sizeof(struct variable_bundle_args));
-                new_variable_args->to_download = unique_bundles;
-                new_variable_args->output_file = output_file;
-                new_variable_args->file_index = i;
-                new_variable_args->index = index;
-                new_variable_args->threads_visited = threads_visited;
-                new_variable_args->index_lock = index_lock;
-                new_bundle_args->variable_args = new_variable_args;
-                pthread_create(&tid[threads_created], NULL, download_and_write_bundle, new_bundle_args);
-                current_index++;
-                threads_created++;
-            }
-            pthread_mutex_unlock(index_lock);
-            if (amount_of_threads == 1)
+            } else if (args->verify_only) {
+                printf("File %s is missing.\n", to_download.name);
+                free(file_output_path);
                 continue;
-        }
-        if (threads_created == amount_of_threads && current_index < unique_bundles->length) {
-            while (1) {
-                if (!do_read) {
-                    do_read = true;
-                } else {
-                    assert(read(pipe_from_downloader[0], &(uint8_t) {0}, 1) == 1);
+            }
+
+            if (fixup) {
+                printf("%s file %s...\n", args->patch ? "Patching" : "Fixing up", to_download.name);
+                preallocated = size_output_file(file_output_path, to_download.file_size, false);
+                if (chunks_to_download.length == 0) {
+                    free(chunks_to_download.objects);
+                    free(file_output_path);
+                    continue;
                 }
-                if (file_index_finished == (int32_t) i) {
-                    do_read = false;
-                    break;
+            } else {
+                printf("%s file %s...\n", filesystem_only ? "Processing" : "Downloading", to_download.name);
+                create_dirs(file_output_path, false);
+                preallocated = size_output_file(file_output_path, to_download.file_size, true);
+                if (to_download.chunks.length == 0) {
+                    free(file_output_path);
+                    continue;
                 }
-                struct variable_bundle_args* new_variable_bundle_args = malloc(sizeof(struct variable_bundle_args));
-                new_variable_bundle_args->index = index;
-                new_variable_bundle_args->threads_visited = threads_visited;
-                new_variable_bundle_args->index_lock = index_lock;
-                new_variable_bundle_args->output_file = output_file;
-                new_variable_bundle_args->file_index = i;
-                new_variable_bundle_args->to_download = unique_bundles;
-                assert(write(pipe_to_downloader[1], &new_variable_bundle_args, sizeof(struct variable_bundle_args*)) == sizeof(struct variable_bundle_args*));
-                if (amount_of_threads == 1 || unique_bundles->length == 1)
-                    break;
+                initialize_list_size(&chunks_to_download, to_download.chunks.length);
+                add_objects(&chunks_to_download, to_download.chunks.objects, to_download.chunks.length);
             }
+            v_printf(2, "Downloading to %s\n", file_output_path);
+            if (plan->mmap_output && !preallocated)
+                v_printf(1, "Info: Couldn't preallocate \"%s\", it's written instead of mapped.\n", file_output_path);
+            add_object(&pipeline.paths, &file_output_path);
+            add_object(&plan->output_files, (&(struct output_file) {
+                .path = file_output_path,
+                .path_index = pipeline.paths.length - 1,
+                .size = to_download.file_size,
+                .preallocated = preallocated
+            }));
+            add_object(&needed_chunks, &chunks_to_download);
         }
-    }
+        for (uint32_t i = 0; i < batch->files.length; i++) {
+            free(batch->files.objects[i].path);
+            free(batch->files.objects[i].valid_chunks);
+        }
+        bool last_batch = batch->end == args->to_download->length;
+        free(batch->files.objects);
+        free(batch);
+        build_download_plan(&pipeline, plan, needed_chunks.objects);
+        for (uint32_t i = 0; i < needed_chunks.length; i++) {
+            free(needed_chunks.objects[i].objects);
+        }
+        free(needed_chunks.objects);
 
-    for (int i = 0; i < threads_created; i++) {
-        if (!do_read)
-            do_read = true;
-        else
-            assert(read(pipe_from_downloader[0], &(uint8_t) {0}, 1) == 1);
-        assert(write(pipe_to_downloader[1], &(void*) {NULL}, sizeof(NULL)) == sizeof(NULL));
+        if (plan->unique_chunks.length == 0) {
+            free_download_plan(plan);
+            continue;
+        }
+        plan->bundles = group_by_bundles(&plan->unique_chunks);
+        atomic_fetch_add(&pipeline.bundle_count, plan->bundles->length);
+        v_printf(1, "Info: Fetching %u chunks from %u bundles.\n", plan->unique_chunks.length, plan->bundles->length);
+#ifndef _WIN32
+        if (pipeline.map_bundles) {
+            plan->bundle_cache = malloc(sizeof(BundleCache));
+            initialize_bundle_cache(plan->bundle_cache, plan->bundles->length, BUNDLE_CACHE_SIZE);
+        }
+#endif
+        // started for the first plan with chunks; if that's the only one, there's no use in more threads than chunks
+        if (!pipeline.plans)
+            start_pipeline(&pipeline, host_port, last_batch ? (int) min((uint32_t) amount_of_threads, plan->unique_chunks.length) : amount_of_threads);
+        add_plan(&pipeline, plan);
     }
-    for (int i = 0; i < threads_created; i++) {
-        void* to_free;
-        pthread_join(tid[i], &to_free);
-        if (is_ssl) free(((struct bundle_args*) to_free)->ssl_structs.io_buffer);
-        free(to_free);
+    pthread_join(verify_tid, NULL);
+    free_bounded_queue(&verified_batches);
+    if (pipeline.plans)
+        finish_pipeline(&pipeline);
+    copy_fetched_chunks(&pipeline);
+    for (uint32_t i = 0; i < pipeline.paths.length; i++) {
+        free(pipeline.paths.objects[i]);
     }
+    free(pipeline.paths.objects);
+    free_hash_index(&pipeline.fetched_chunks);
+    free(pipeline.chunk_sources.objects);
+    free(pipeline.chunk_copies.objects);
+    pthread_mutex_destroy(&pipeline.open_files.lock);
     free(host_port->host);
     free(host_port);
-    close(pipe_from_downloader[0]);
-    close(pipe_from_downloader[1]);
-    close(pipe_to_downloader[0]);
-    close(pipe_to_downloader[1]);
 }
@@ -3,11 +3,17 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
+#include "bounded_queue.h"
+#include "bundle_cache.h"
+#include "file_writer.h"
+#include "hash_index.h"
+#include "job_system.h"
+#include "list.h"
 #include "rman.h"
 #include "socket_utils.h"
 
-extern int amount_of_threads;
 extern const char* bundle_base;
 
 struct download_args {
@@ -18,21 +24,204 @@ struct download_args {
     bool verify_only;
     bool skip_existing;
     bool existing_only;
+    bool patch; // files exist with their final size already and only the listed chunks need to be written, see patch.h
+    int decompress_threads; // 0 for as many as download threads
+    int write_threads; // 0 for one
+    bool io_uring; // read bundles and write files through io_uring, if the system allows
+    bool sparse; // leave chunks that are all zeroes as holes instead of writing them
+    bool direct_io; // write whole blocks of files with O_DIRECT, past the page cache
+    bool mmap_output; // decompress chunks straight into mappings of the files instead of writing them
 };
+struct output_file {
+    char* path; // owned by the pipeline, see download_pipeline.paths
+    uint32_t path_index; // in download_pipeline.paths
+    // fd and the fields after it are guarded by the lock of the open file list
+    int fd; // opened for a batch of writes and closed after the last one (or for another file), -1 while closed
+    int direct_fd; // opened and closed along with fd if the plan uses direct i/o and the file system allows
+    uint32_t direct_alignment; // of direct_fd, see direct_io_alignment
+    bool direct_refused; // a direct write failed with EINVAL, the file is only written through fd from then on
+    int retired_direct_fd; // direct_fd from before that, closed along with fd since other writes may still use it
+    uint32_t users; // batches of writes currently using fd, it's only closed early while there are none
+    struct output_file* older; // neighbours in the list of open files
+    struct output_file* newer;
+    uint64_t size;
+    bool preallocated; // its blocks are allocated, so it can be mapped without running out of space as SIGBUS later
+    _Atomic(uint8_t*) mapping; // made for the first chunk and unmapped after the last one if the plan maps output files
+    atomic_uint_fast32_t pending_writes;
+};
+// The output files with open fds, of all plans, from least to most recently used. The least recently used ones are
+// closed to stay below max_count, or when there are no descriptors left.
+struct open_file_list {
+    pthread_mutex_t lock; // also guards the mappings of output files while they're made
+    struct output_file* oldest; // NULL while there are none
+    struct output_file* newest;
+    uint32_t count;
+    uint32_t max_count;
+};
+struct chunk_destination {
+    uint32_t output_index;
+    uint64_t file_offset;
+};
+struct download_pipeline;
+// Every chunk that has to be written somewhere is downloaded and decompressed once, then written to all its
+// destinations. A plan covers the files of one verified batch; it's freed once all of its work is done.
+struct download_plan {
+    struct download_pipeline* pipeline;
+    uint32_t list; // of the plan's jobs
+    LIST(struct output_file) output_files;
+    ChunkList unique_chunks; // in order of first use
+    HashIndex chunk_index; // chunk_id -> index into unique_chunks
+    uint32_t* destination_starts; // the destinations of unique_chunks[i] are destinations[destination_starts[i]] up to destinations[destination_starts[i + 1]]
+    struct chunk_destination* destinations;
+    BundleList* bundles; // unique_chunks grouped by bundle, jobs are ranges of chunks in them
+    BundleCache* bundle_cache; // to map bundles from disk, NULL to read them through io
+    bool direct_io; // output files get a direct_fd too
+    bool mmap_output; // preallocated output files are mapped and written by the decompression threads, others are written
+    // held by the jobs and the items in the pipeline that are about this plan, and by download_files until all its
+    // jobs are pushed
+    atomic_uint_fast32_t references;
+};
+// Items that are handed back once their consumer is done with them, so that neither they nor their buffers have to
+// be allocated again for every job. There are only as many as the stages and queues can hold at once; taking one
+// while all are in use waits for one to come back.
+struct item_pool {
+    BoundedQueue free_items;
+    size_t buffer_size; // of the buffer every item has
+    uint32_t limit;
+    atomic_uint_fast32_t allocated;
+};
+// chunks of a job that were read or downloaded but not decompressed yet, stored in buffer or a mapped bundle
+struct fetched_chunks {
+    struct download_plan* plan; // referenced until the chunks are decompressed
+    ChunkList chunks; // points into the bundle's chunk list
+    const uint8_t** ranges; // the data of chunks.objects[i]
+    uint32_t ranges_capacity;
+    uint8_t* buffer; // NULL if the pool's items have none
+    size_t used;
+    MappedBundle* mapping; // held until the chunks are decompressed, NULL if they're in buffer
+    uint32_t done_count; // of chunks, the others are still being received
+    struct fetched_chunks* next; // filled after this one, while both are in a fetch_sink
+};
+// Collects chunks streamed in by get_ranges or download_ranges into fetched_chunks, which are passed on once they're
+// full and all their chunks are done. Buffers may be handed out ahead, so there can be more than one in progress.
+struct fetch_sink {
+    struct download_plan* plan;
+    struct item_pool* pool;
+    BoundedQueue* output;
+    const ChunkList* chunks;
+    struct fetched_chunks* oldest; // not passed on yet
+    struct fetched_chunks* current; // being filled
+};
+// decompressed chunks that still have to be written, all stored in buffer
+struct chunk_writes {
+    struct download_plan* plan; // referenced until the writes are done
+    WriteBatch batch;
+    uint8_t* buffer;
+    size_t used;
+};
+// Downloads run in three stages, each on its own threads: download threads (one connection each) only fetch chunks,
+// decompression threads turn them into writes and write threads do those, connected by bounded queues.
 struct bundle_args {
     bool filesystem_only;
+    struct download_plan** plans; // by the list of a job, jobs are ranges of chunks in the plan's bundles
+    JobSystem* jobs;
+    int worker;
+    BoundedQueue* output; // of fetched_chunks
+    struct item_pool* fetch_pool;
     struct ssl_data ssl_structs;
-    int coordinate_pipes[2];
-    int32_t* file_index_finished;
-    struct variable_bundle_args* variable_args;
-};
-struct variable_bundle_args {
-    BundleList* to_download;
-    FILE* output_file;
-    int32_t file_index;
-    uint32_t* index;
-    int* threads_visited;
-    pthread_mutex_t* index_lock;
+    IoEngine io;
+};
+struct stage_args {
+    BoundedQueue* input; // a NULL item tells a thread to stop
+    BoundedQueue* output; // of chunk_writes, for decompression threads
+    struct item_pool* input_pool; // where input items go once used, for decompression threads
+    struct item_pool* write_pool;
+    bool io_uring; // for write threads
+    bool sparse; // for decompression threads
+};
+// an existing file whose chunks are checked before anything is downloaded for it
+struct verified_file {
+    uint32_t file_index; // in download_args.to_download
+    const File* file;
+    char* path;
+    uint64_t size; // on disk
+    bool* valid_chunks; // per chunk of file, filled in by the verification threads
+    atomic_bool failed; // some chunk is invalid, with verify_only the rest aren't checked anymore
+};
+// Verification runs on its own threads before the download, as jobs of chunks of the files (big files are split
+// into several), so that hashing isn't limited to a single core.
+struct verify_args {
+    struct verified_file* files;
+    JobSystem* jobs; // jobs are ranges of chunks in files
+    int worker;
+    bool verify_only;
+};
+// the files to_download[start] up to to_download[end], with the results for those of them that exist
+struct verify_batch {
+    uint32_t start;
+    uint32_t end;
+    LIST(struct verified_file) files;
+};
+// the bytes of a bundle some file may need, see check_bundles
+struct bundle_extent {
+    uint64_t bundle_id;
+    uint64_t end; // of the last chunk in it
+};
+struct verify_ahead_args {
+    struct download_args* download_args;
+    BoundedQueue* output; // of verify_batch, NULL after the last one
+};
+
+// where a chunk fetched by an earlier plan was written to
+struct chunk_location {
+    uint32_t path_index;
+    uint64_t file_offset;
+};
+// a chunk that's copied from where an earlier plan wrote it instead of being fetched again
+struct chunk_copy {
+    uint32_t source; // index into download_pipeline.chunk_sources
+    uint32_t path_index;
+    uint64_t file_offset;
+    uint32_t size;
+};
+// Everything downloads run on: the threads of the three stages (with a connection for every download thread), the
+// queues and pools between them and the jobs they take. It's started for the first plan that needs chunks and kept
+// for all later ones, whose jobs are pushed as their batches are verified.
+struct download_pipeline {
+    struct download_args* args;
+    bool filesystem_only;
+    bool is_ssl;
+    bool map_bundles; // plans get a BundleCache
+    struct download_plan** plans; // by list, pointers to plans that are done are left dangling
+    uint32_t plan_count;
+    JobSystem jobs; // held until the last plan is added
+    int thread_count;
+    int decompress_count;
+    int write_count;
+    BoundedQueue fetched_queue;
+    BoundedQueue write_queue;
+    struct item_pool fetch_pool;
+    struct item_pool write_pool;
+    pthread_t* fetch_tids;
+    pthread_t* decompress_tids;
+    pthread_t* write_tids;
+    struct bundle_args* fetch_args;
+    struct stage_args decompress_args;
+    struct stage_args write_args;
+    struct open_file_list open_files;
+    uint64_t start_time;
+    uint64_t start_allocations; // for MALLOC_STATS
+    // totals of all plans
+    atomic_uint_fast64_t chunk_writes;
+    atomic_uint_fast64_t write_calls;
+    atomic_uint_fast32_t bundle_mappings;
+    atomic_uint_fast32_t bundle_count;
+    // Chunks fetched by an earlier plan aren't fetched again for a later one, they're copied from the first file
+    // they were written to once all plans are done. Only used by download_files.
+    HashIndex fetched_chunks; // chunk_id -> index into chunk_sources
+    LIST(struct chunk_location) chunk_sources;
+    LIST(struct chunk_copy) chunk_copies;
+    LIST(char*) paths; // of all output files, plans only borrow them
 };
 
 void download_files(struct download_args* args);
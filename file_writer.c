@@ -0,0 +1,296 @@
+#define _FILE_OFFSET_BITS 64
+#ifdef __linux__
+    #define _GNU_SOURCE // for fallocate and statx
+    #include <fcntl.h>
+    #include <sys/stat.h>
+#endif
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#endif
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "defs.h"
+#include "file_writer.h"
+#include "io_engine.h"
+#include "list.h"
+
+
+bool write_at(int fd, uint64_t offset, const void* data, size_t length)
+{
+    const uint8_t* position = data;
+    while (length > 0) {
+#ifndef _WIN32
+        ssize_t written = pwrite(fd, position, length, offset);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+#else
+        // WriteFile with an explicit offset is the positional write on windows, and doesn't touch the file position either
+        OVERLAPPED overlapped = {.Offset = (DWORD) offset, .OffsetHigh = (DWORD) (offset >> 32)};
+        DWORD written;
+        if (!WriteFile((HANDLE) _get_osfhandle(fd), position, min(length, (size_t) 1 << 30), &written, &overlapped) || written == 0)
+            return false;
+#endif
+        position += written;
+        offset += written;
+        length -= written;
+    }
+
+    return true;
+}
+
+bool preallocate_file(int fd, uint64_t size)
+{
+#ifdef __linux__
+    // not posix_fallocate, which falls back to writing every block if the file system can't allocate them
+    return size == 0 || fallocate(fd, 0, 0, size) == 0;
+#else
+    (void) fd;
+    (void) size;
+    return false;
+#endif
+}
+
+uint32_t direct_io_alignment(int fd)
+{
+#ifndef _WIN32
+    uint32_t alignment = sysconf(_SC_PAGESIZE);
+#else
+    uint32_t alignment = 4096;
+#endif
+#if defined(__linux__) && defined(STATX_DIOALIGN)
+    // file systems with bigger blocks (or stricter devices) than pages say so here since linux 6.1
+    struct statx info;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &info) == 0 && info.stx_mask & STATX_DIOALIGN) {
+        if (info.stx_dio_offset_align == 0)
+            return 0;
+        alignment = max(alignment, max(info.stx_dio_offset_align, info.stx_dio_mem_align));
+    }
+#else
+    (void) fd;
+#endif
+
+    return alignment;
+}
+
+// zeroes written where holes can't be punched
+static const uint8_t zeroes[64 * 1024];
+
+// Makes length bytes at offset of fd read as zeroes by deallocating them, or else queues writes of zeroes to io.
+// Returns whether a hole was punched.
+static bool punch_hole(IoEngine* io, int fd, uint64_t offset, uint64_t length)
+{
+#ifdef __linux__
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        return true;
+#endif
+    add_io_request(io, fd, offset);
+    for (uint64_t position = 0; position < length; position += sizeof(zeroes)) {
+        add_io_vector(io, (void*) zeroes, min(length - position, (uint64_t) sizeof(zeroes)));
+    }
+
+    return false;
+}
+
+static inline bool write_before(const FileWrite* a, const FileWrite* b)
+{
+    return a->fd < b->fd || (a->fd == b->fd && a->offset < b->offset);
+}
+
+// bottom-up merge sort by fd and offset, stable and without allocating once scratch is big enough
+static void sort_writes(WriteBatch* batch, WriteBatch* scratch)
+{
+    uint32_t i = 1;
+    while (i < batch->length && !write_before(&batch->objects[i], &batch->objects[i - 1]))
+        i++;
+    // chunks of a bundle are mostly in file order already
+    if (i >= batch->length)
+        return;
+    if (scratch->allocated_length < batch->length) {
+        scratch->allocated_length = batch->length;
+        scratch->objects = realloc(scratch->objects, scratch->allocated_length * sizeof(FileWrite));
+    }
+    FileWrite* from = batch->objects;
+    FileWrite* to = scratch->objects;
+    for (uint32_t width = 1; width < batch->length; width *= 2) {
+        for (uint32_t start = 0; start < batch->length; start += 2 * width) {
+            uint32_t middle = min(start + width, batch->length);
+            uint32_t end = min(start + 2 * width, batch->length);
+            uint32_t left = start, right = middle;
+            for (uint32_t k = start; k < end; k++) {
+                if (left < middle && (right >= end || !write_before(&from[right], &from[left])))
+                    to[k] = from[left++];
+                else
+                    to[k] = from[right++];
+            }
+        }
+        FileWrite* swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != batch->objects)
+        memcpy(batch->objects, from, batch->length * sizeof(FileWrite));
+}
+
+void initialize_file_writer(FileWriter* writer, bool use_io_uring)
+{
+    initialize_list(&writer->scratch);
+    initialize_io_engine(&writer->io, use_io_uring);
+    writer->direct_buffer = NULL;
+    writer->direct_buffer_size = 0;
+}
+
+// index of the first write after the run starting at start, a run being writes of the same kind contiguous in a file
+static uint32_t find_run_end(const WriteBatch* batch, uint32_t start, uint64_t* run_end)
+{
+    const FileWrite* first = &batch->objects[start];
+    uint32_t end = start + 1;
+    *run_end = first->offset + first->length;
+    while (end < batch->length && batch->objects[end].fd == first->fd && batch->objects[end].offset == *run_end
+        && !batch->objects[end].data == !first->data) {
+        *run_end += batch->objects[end].length;
+        end++;
+    }
+
+    return end;
+}
+
+// queues a write of the bytes from offset to end of the run of count writes to fd
+static void add_run_part(IoEngine* io, int fd, const FileWrite* writes, uint32_t count, uint64_t offset, uint64_t end)
+{
+    add_io_request(io, fd, offset);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t start = max(offset, writes[i].offset);
+        uint64_t stop = min(end, writes[i].offset + writes[i].length);
+        if (start < stop)
+            add_io_vector(io, (void*) (writes[i].data + (start - writes[i].offset)), stop - start);
+    }
+}
+
+static void copy_run_part(uint8_t* destination, const FileWrite* writes, uint32_t count, uint64_t offset, uint64_t end)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t start = max(offset, writes[i].offset);
+        uint64_t stop = min(end, writes[i].offset + writes[i].length);
+        if (start < stop)
+            memcpy(destination + (start - offset), writes[i].data + (start - writes[i].offset), stop - start);
+    }
+}
+
+static inline uint64_t align_up(uint64_t offset, uint32_t alignment)
+{
+    return (offset + alignment - 1) & ~(uint64_t) (alignment - 1);
+}
+
+static inline uint64_t align_down(uint64_t offset, uint32_t alignment)
+{
+    return offset & ~(uint64_t) (alignment - 1);
+}
+
+// whether the run starting with first has whole blocks to write through its direct fd
+static inline bool direct_run(const FileWrite* first, uint64_t run_end)
+{
+    return first->data && first->direct_fd != -1
+        && align_up(first->offset, first->direct_alignment) < align_down(run_end, first->direct_alignment);
+}
+
+// queues all runs of batch to writer's io engine, with or without their direct fds, and returns the number of writes
+static int queue_runs(FileWriter* writer, WriteBatch* batch, bool use_direct)
+{
+    IoEngine* io = &writer->io;
+    int write_calls = 0;
+    size_t direct_used = 0;
+    uint64_t run_end;
+    for (uint32_t start = 0; start < batch->length;) {
+        const FileWrite* first = &batch->objects[start];
+        uint32_t end = find_run_end(batch, start, &run_end);
+        if (!first->data) {
+            write_calls += punch_hole(io, first->fd, first->offset, run_end - first->offset);
+        } else if (use_direct && direct_run(first, run_end)) {
+            uint64_t aligned_start = align_up(first->offset, first->direct_alignment);
+            uint64_t aligned_end = align_down(run_end, first->direct_alignment);
+            // only the unaligned head and tail go through the page cache
+            if (first->offset < aligned_start)
+                add_run_part(io, first->fd, first, end - start, first->offset, aligned_start);
+            direct_used = align_up(direct_used, first->direct_alignment);
+            uint8_t* direct_data = writer->direct_buffer + direct_used;
+            copy_run_part(direct_data, first, end - start, aligned_start, aligned_end);
+            add_io_request(io, first->direct_fd, aligned_start);
+            add_io_vector(io, direct_data, aligned_end - aligned_start);
+            direct_used += aligned_end - aligned_start;
+            if (aligned_end < run_end)
+                add_run_part(io, first->fd, first, end - start, aligned_end, run_end);
+        } else {
+            add_run_part(io, first->fd, first, end - start, first->offset, run_end);
+        }
+        start = end;
+    }
+
+    return write_calls + io->requests.length;
+}
+
+int write_batch(FileWriter* writer, WriteBatch* batch)
+{
+    sort_writes(batch, &writer->scratch);
+
+    // the blocks covered completely by runs with a direct fd are copied to an aligned buffer, all at once
+    size_t direct_size = 0;
+    uint32_t buffer_alignment = 1;
+    uint64_t run_end;
+    for (uint32_t start = 0; start < batch->length;) {
+        const FileWrite* first = &batch->objects[start];
+        uint32_t end = find_run_end(batch, start, &run_end);
+        if (direct_run(first, run_end)) {
+            direct_size = align_up(direct_size, first->direct_alignment);
+            direct_size += align_down(run_end, first->direct_alignment) - align_up(first->offset, first->direct_alignment);
+            buffer_alignment = max(buffer_alignment, first->direct_alignment);
+        }
+        start = end;
+    }
+#ifndef _WIN32
+    if (direct_size > writer->direct_buffer_size || (uintptr_t) writer->direct_buffer & (buffer_alignment - 1)) {
+        free(writer->direct_buffer);
+        writer->direct_buffer_size = 0;
+        if (posix_memalign((void**) &writer->direct_buffer, buffer_alignment, direct_size) != 0) {
+            writer->direct_buffer = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+        writer->direct_buffer_size = direct_size;
+    }
+#endif
+
+    int write_calls = queue_runs(writer, batch, true);
+    if (run_io(&writer->io, true))
+        return write_calls;
+    if (errno != EINVAL || direct_size == 0)
+        return -1;
+    // Some file system took the direct fd but not its writes (alignment it didn't report, or no O_DIRECT support
+    // after all). Plain writes don't fail with EINVAL, so everything is written again without direct fds.
+    for (uint32_t start = 0; start < batch->length;) {
+        uint32_t end = find_run_end(batch, start, &run_end);
+        if (direct_run(&batch->objects[start], run_end)) {
+            for (uint32_t i = start; i < end; i++) {
+                batch->objects[i].direct_failed = true;
+            }
+        }
+        start = end;
+    }
+    write_calls += queue_runs(writer, batch, false);
+
+    return run_io(&writer->io, true) ? write_calls : -1;
+}
+
+void free_file_writer(FileWriter* writer)
+{
+    free(writer->scratch.objects);
+    free_io_engine(&writer->io);
+    free(writer->direct_buffer);
+}
@@ -0,0 +1,56 @@
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "io_engine.h"
+#include "list.h"
+
+typedef struct file_write {
+    int fd;
+    int direct_fd; // if not -1, an O_DIRECT fd of the same file for the blocks the write covers completely
+    uint32_t direct_alignment; // the blocks of direct_fd, see direct_io_alignment
+    bool direct_failed; // set by write_batch if direct_fd refused the write (EINVAL) and fd was used instead
+    uint32_t tag; // not used by the writer, lets the caller tell writes apart after they're done
+    uint64_t offset;
+    const uint8_t* data; // NULL for length zeroes, which are left as a hole where possible
+    uint32_t length;
+} FileWrite;
+
+typedef LIST(FileWrite) WriteBatch;
+
+// what a thread doing write_batch keeps for all batches
+typedef struct file_writer {
+    WriteBatch scratch; // sorting space
+    IoEngine io;
+    uint8_t* direct_buffer; // aligned copies of the data written through direct fds
+    size_t direct_buffer_size;
+} FileWriter;
+
+// Writes length bytes of data to offset of fd without using (or moving) the file position, so any number of threads
+// can write to the same fd at once. Returns false if not all data could be written.
+bool write_at(int fd, uint64_t offset, const void* data, size_t length);
+
+// Allocates the blocks of the first size bytes of fd up front (linux only), so that writes coming in in any order
+// don't leave the file fragmented. Returns false if the file system (or system) can't do that.
+bool preallocate_file(int fd, uint64_t size);
+
+// Returns what file offsets, lengths and memory of O_DIRECT writes to fd have to be multiples of: the page size, or
+// more if the file system asks for it. Returns 0 if fd can't do direct i/o at all.
+uint32_t direct_io_alignment(int fd);
+
+void initialize_file_writer(FileWriter* writer, bool use_io_uring);
+
+// Writes every write of batch. Writes to the same fd that are contiguous in the file are merged into one vectored
+// write (or one punched hole for zeroes), in whatever order they were added; with a direct fd, the whole blocks of
+// such a run are copied into an aligned buffer and written with O_DIRECT, bypassing the page cache, and only the
+// partial blocks at either end are written normally. If the file system refuses direct writes after all, the batch is
+// written again through the plain fds and the writes that had direct fds get direct_failed set. Leaves batch sorted by fd and offset and returns the number of
+// writes needed, or -1 if any of them failed.
+int write_batch(FileWriter* writer, WriteBatch* batch);
+
+void free_file_writer(FileWriter* writer);
+
+#endif
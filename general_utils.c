@@ -9,6 +9,9 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include "general_utils.h"
 #include "defs.h"
@@ -93,3 +96,52 @@ int create_dirs(char* dir_path, bool create_last)
         return -1;
     return 0;
 }
+
+uint64_t nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+struct parallel_for_args {
+    uint32_t count;
+    uint32_t block_size;
+    atomic_uint_fast32_t next_block;
+    void (*work)(void* data, uint32_t start, uint32_t end);
+    void* data;
+};
+
+static void* parallel_for_worker(void* _args)
+{
+    struct parallel_for_args* args = _args;
+    uint32_t block_count = (args->count + args->block_size - 1) / args->block_size;
+    uint32_t block;
+    while ( (block = atomic_fetch_add(&args->next_block, 1)) < block_count) {
+        uint32_t start = block * args->block_size;
+        args->work(args->data, start, min(start + args->block_size, args->count));
+    }
+
+    return NULL;
+}
+
+void parallel_for(uint32_t count, uint32_t block_size, int thread_count, void (*work)(void* data, uint32_t start, uint32_t end), void* data)
+{
+    struct parallel_for_args args = {
+        .count = count,
+        .block_size = block_size,
+        .work = work,
+        .data = data
+    };
+    atomic_init(&args.next_block, 0);
+    int extra_threads = min(thread_count, (int) ((count + block_size - 1) / block_size)) - 1;
+    pthread_t tid[max(extra_threads, 1)];
+    for (int i = 0; i < extra_threads; i++) {
+        pthread_create(&tid[i], NULL, parallel_for_worker, &args);
+    }
+    parallel_for_worker(&args);
+    for (int i = 0; i < extra_threads; i++) {
+        pthread_join(tid[i], NULL);
+    }
+}
@@ -2,6 +2,7 @@
 #define GENERAL_UTILS_H
 
 #include <stdbool.h>
+#include <inttypes.h>
 
 char* lower(const char* string);
 
@@ -15,4 +16,11 @@ int create_dir(char* path);
 
 int create_dirs(char* dir_path, bool create_last);
 
+// monotonic clock, for measuring durations
+uint64_t nanoseconds(void);
+
+// Calls work on consecutive ranges of at most block_size items until [0, count) is covered, using up to
+// thread_count threads (the calling one included). Returns once all items were processed.
+void parallel_for(uint32_t count, uint32_t block_size, int thread_count, void (*work)(void* data, uint32_t start, uint32_t end), void* data);
+
 #endif
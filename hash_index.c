@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "hash_index.h"
+
+
+static void allocate_slots(HashIndex* index, uint32_t slot_count)
+{
+    index->mask = slot_count - 1;
+    index->shift = 64 - __builtin_ctz(slot_count);
+    index->slots = malloc(slot_count * sizeof(struct hash_index_slot));
+    // all bytes 0xFF make every value HASH_INDEX_EMPTY
+    memset(index->slots, 0xFF, slot_count * sizeof(struct hash_index_slot));
+}
+
+void initialize_hash_index(HashIndex* index, uint32_t expected_length)
+{
+    // keep the load factor at or below 1/2 for the expected amount of keys
+    uint32_t slot_count = 16;
+    while (slot_count < 2 * (uint64_t) expected_length)
+        slot_count *= 2;
+    index->length = 0;
+    allocate_slots(index, slot_count);
+}
+
+static void grow(HashIndex* index)
+{
+    struct hash_index_slot* old_slots = index->slots;
+    uint32_t old_slot_count = index->mask + 1;
+    allocate_slots(index, 2 * old_slot_count);
+    for (uint32_t i = 0; i < old_slot_count; i++) {
+        if (old_slots[i].value == HASH_INDEX_EMPTY)
+            continue;
+        uint32_t slot = hash_index_slot_of(index, old_slots[i].key);
+        while (index->slots[slot].value != HASH_INDEX_EMPTY)
+            slot = (slot + 1) & index->mask;
+        index->slots[slot] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+bool hash_index_insert(HashIndex* index, uint64_t key, uint32_t value)
+{
+    if (2 * (index->length + 1) > index->mask + 1)
+        grow(index);
+
+    uint32_t slot = hash_index_slot_of(index, key);
+    for (; index->slots[slot].value != HASH_INDEX_EMPTY; slot = (slot + 1) & index->mask) {
+        if (index->slots[slot].key == key)
+            return false;
+    }
+    index->slots[slot].key = key;
+    index->slots[slot].value = value;
+    index->length++;
+
+    return true;
+}
+
+void free_hash_index(HashIndex* index)
+{
+    free(index->slots);
+    index->slots = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define HASH_INDEX_EMPTY UINT32_MAX
+
+// open-addressing (linear probing) map from 64 bit keys to 32 bit values, usually an index into some list.
+// HASH_INDEX_EMPTY can't be stored as a value, it marks unused slots.
+typedef struct hash_index {
+    uint32_t length;
+    uint32_t mask;
+    int shift;
+    struct hash_index_slot {
+        uint64_t key;
+        uint32_t value;
+    }* slots;
+} HashIndex;
+
+void initialize_hash_index(HashIndex* index, uint32_t expected_length);
+
+// inserts key if it isn't in the index yet; returns false (and leaves the stored value as is) otherwise
+bool hash_index_insert(HashIndex* index, uint64_t key, uint32_t value);
+
+void free_hash_index(HashIndex* index);
+
+static inline uint32_t hash_index_slot_of(const HashIndex* index, uint64_t key)
+{
+    // fibonacci hashing; keys are often hashes already, but directory ids and the like aren't guaranteed to be
+    return (key * 0x9E3779B97F4A7C15ull) >> index->shift;
+}
+
+// returns the value stored for key, or HASH_INDEX_EMPTY if key isn't in the index
+static inline uint32_t hash_index_find(const HashIndex* index, uint64_t key)
+{
+    for (uint32_t slot = hash_index_slot_of(index, key); index->slots[slot].value != HASH_INDEX_EMPTY; slot = (slot + 1) & index->mask) {
+        if (index->slots[slot].key == key)
+            return index->slots[slot].value;
+    }
+
+    return HASH_INDEX_EMPTY;
+}
+
+#endif
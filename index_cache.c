@@ -0,0 +1,471 @@
+#define _FILE_OFFSET_BITS 64
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "arena.h"
+#include "defs.h"
+#include "hash_index.h"
+#include "index_cache.h"
+#include "list.h"
+#include "rman.h"
+
+
+#define INDEX_CACHE_VERSION 1
+#define SECTION_ALIGNMENT 16
+
+enum section {
+    SECTION_BUNDLES, // struct cached_bundle[bundle_count]
+    SECTION_BUNDLE_CHUNKS, // Chunk[chunk_count], the chunks of all bundles one after another
+    SECTION_CHUNKS, // Chunk[chunk_count], sorted by chunk_id
+    SECTION_CHUNK_INDEX, // struct hash_index_slot[chunk_index_mask + 1]
+    SECTION_LANGUAGES, // struct cached_language[language_count]
+    SECTION_PARAMETERS, // Parameters[parameter_count]
+    SECTION_FILES, // struct cached_file[file_count]
+    SECTION_FILE_CHUNKS, // Chunk[file_chunk_count], the chunks of all files one after another
+    SECTION_STRINGS, // strings_size bytes of nul-terminated strings, starting with an empty one
+    SECTION_COUNT
+};
+
+// strings are stored as offsets into the string section, everything else as indices into the other sections
+struct cached_bundle {
+    uint64_t bundle_id;
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+};
+
+struct cached_language {
+    uint64_t name;
+    uint32_t language_id;
+};
+
+struct cached_file {
+    uint64_t name;
+    uint64_t link;
+    uint64_t file_size;
+    uint64_t language_mask;
+    uint64_t first_chunk;
+    uint32_t chunk_count;
+};
+
+// the record sizes are part of the header, so that cache files written by an incompatible build get rejected
+#define RECORD_SIZES ((uint32_t) (sizeof(Chunk) | sizeof(struct hash_index_slot) << 8 | sizeof(Parameters) << 16 | sizeof(struct cached_file) << 24))
+
+struct index_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t manifest_id;
+    uint32_t record_sizes;
+    uint32_t bundle_count;
+    uint32_t chunk_count;
+    uint32_t language_count;
+    uint32_t parameter_count;
+    uint32_t file_count;
+    uint32_t chunk_index_mask;
+    int32_t chunk_index_shift;
+    uint64_t file_chunk_count;
+    uint64_t strings_size;
+    uint64_t offsets[SECTION_COUNT];
+};
+
+struct index_cache {
+    uint8_t* data;
+    size_t size;
+};
+
+#define section_of(index_cache, section) ((void*) ((index_cache)->data + ((struct index_cache_header*) (index_cache)->data)->offsets[section]))
+
+
+static char* cache_file_path(const char* cache_dir, uint64_t manifest_id)
+{
+    char* path = malloc(strlen(cache_dir) + 1 + 16 + sizeof(".index"));
+    sprintf(path, "%s/%016"PRIX64".index", cache_dir, manifest_id);
+    return path;
+}
+
+static uint64_t section_size(const struct index_cache_header* header, enum section section)
+{
+    switch (section) {
+        case SECTION_BUNDLES: return (uint64_t) header->bundle_count * sizeof(struct cached_bundle);
+        case SECTION_BUNDLE_CHUNKS:
+        case SECTION_CHUNKS: return (uint64_t) header->chunk_count * sizeof(Chunk);
+        case SECTION_CHUNK_INDEX: return ((uint64_t) header->chunk_index_mask + 1) * sizeof(struct hash_index_slot);
+        case SECTION_LANGUAGES: return (uint64_t) header->language_count * sizeof(struct cached_language);
+        case SECTION_PARAMETERS: return (uint64_t) header->parameter_count * sizeof(Parameters);
+        case SECTION_FILES: return (uint64_t) header->file_count * sizeof(struct cached_file);
+        case SECTION_FILE_CHUNKS: return header->file_chunk_count * sizeof(Chunk);
+        case SECTION_STRINGS: return header->strings_size;
+        default: return 0;
+    }
+}
+
+// Checks that every table and every reference between them stays inside the file. The chunk index itself isn't
+// checked slot by slot, that would mean touching all of it; cache files are only ever replaced atomically.
+static bool index_cache_valid(const struct index_cache* index_cache, uint64_t manifest_id)
+{
+    const struct index_cache_header* header = (struct index_cache_header*) index_cache->data;
+    if (index_cache->size < sizeof(struct index_cache_header) || memcmp(header->magic, "RMIX", 4) != 0
+     || header->version != INDEX_CACHE_VERSION || header->record_sizes != RECORD_SIZES || header->manifest_id != manifest_id)
+        return false;
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        if (header->offsets[i] % SECTION_ALIGNMENT || header->offsets[i] > index_cache->size
+         || section_size(header, i) > index_cache->size - header->offsets[i])
+            return false;
+    }
+    uint32_t slot_count = header->chunk_index_mask + 1;
+    // a mask of all ones wraps around to no slots at all, which ctz can't take
+    if (slot_count == 0 || slot_count & header->chunk_index_mask || header->chunk_index_shift != 64 - __builtin_ctz(slot_count))
+        return false;
+    const char* strings = section_of(index_cache, SECTION_STRINGS);
+    if (header->strings_size == 0 || strings[header->strings_size - 1] != '\0')
+        return false;
+
+    const struct cached_bundle* bundles = section_of(index_cache, SECTION_BUNDLES);
+    for (uint32_t i = 0; i < header->bundle_count; i++) {
+        if ((uint64_t) bundles[i].first_chunk + bundles[i].chunk_count > header->chunk_count)
+            return false;
+    }
+    const struct cached_language* languages = section_of(index_cache, SECTION_LANGUAGES);
+    for (uint32_t i = 0; i < header->language_count; i++) {
+        if (languages[i].name >= header->strings_size)
+            return false;
+    }
+    const struct cached_file* files = section_of(index_cache, SECTION_FILES);
+    for (uint32_t i = 0; i < header->file_count; i++) {
+        if (files[i].name >= header->strings_size || files[i].link >= header->strings_size
+         || files[i].first_chunk > header->file_chunk_count || files[i].chunk_count > header->file_chunk_count - files[i].first_chunk)
+            return false;
+    }
+
+    return true;
+}
+
+Manifest* open_index_cache(const char* cache_dir, uint64_t manifest_id)
+{
+    char* path = cache_file_path(cache_dir, manifest_id);
+    int cache_fd = open(path, O_RDONLY | O_BINARY);
+    if (cache_fd == -1) {
+        v_printf(1, "Info: No index cache file \"%s\" yet.\n", path);
+        free(path);
+        return NULL;
+    }
+    struct stat file_info;
+    if (fstat(cache_fd, &file_info) == -1 || file_info.st_size < (off_t) sizeof(struct index_cache_header)) {
+        eprintf("Warning: Ignoring invalid index cache file \"%s\".\n", path);
+        close(cache_fd);
+        free(path);
+        return NULL;
+    }
+    struct index_cache* index_cache = malloc(sizeof(struct index_cache));
+    index_cache->size = file_info.st_size;
+
+    // mapped copy-on-write, so the tables can be handed out as regular (mutable) lists
+#ifndef _WIN32
+    index_cache->data = mmap(NULL, index_cache->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, cache_fd, 0);
+    close(cache_fd);
+    if (index_cache->data == MAP_FAILED) {
+        eprintf("Warning: Couldn't map index cache file \"%s\".\n", path);
+        free(index_cache);
+        free(path);
+        return NULL;
+    }
+#else
+    index_cache->data = malloc(index_cache->size);
+    bool read_failed = read(cache_fd, index_cache->data, index_cache->size) != (ssize_t) index_cache->size;
+    close(cache_fd);
+    if (read_failed) {
+        eprintf("Warning: Couldn't read index cache file \"%s\".\n", path);
+        close_index_cache(index_cache);
+        free(path);
+        return NULL;
+    }
+#endif
+    if (!index_cache_valid(index_cache, manifest_id)) {
+        eprintf("Warning: Ignoring invalid index cache file \"%s\".\n", path);
+        close_index_cache(index_cache);
+        free(path);
+        return NULL;
+    }
+    v_printf(1, "Info: Loaded manifest from index cache file \"%s\".\n", path);
+    free(path);
+
+    const struct index_cache_header* header = (struct index_cache_header*) index_cache->data;
+    Manifest* manifest = calloc(1, sizeof(Manifest));
+    manifest->manifest_id = manifest_id;
+    manifest->index_cache = index_cache;
+    initialize_arena(&manifest->arena, 64 * 1024);
+
+    manifest->chunks = (ChunkList) {
+        .length = header->chunk_count,
+        .allocated_length = header->chunk_count,
+        .objects = section_of(index_cache, SECTION_CHUNKS)
+    };
+    manifest->chunk_index = (HashIndex) {
+        .length = header->chunk_count,
+        .mask = header->chunk_index_mask,
+        .shift = header->chunk_index_shift,
+        .slots = section_of(index_cache, SECTION_CHUNK_INDEX)
+    };
+
+    const struct cached_bundle* cached_bundles = section_of(index_cache, SECTION_BUNDLES);
+    Chunk* bundle_chunks = section_of(index_cache, SECTION_BUNDLE_CHUNKS);
+    initialize_list_size(&manifest->bundles, max(header->bundle_count, (uint32_t) 1));
+    for (uint32_t i = 0; i < header->bundle_count; i++) {
+        Bundle bundle = {
+            .bundle_id = cached_bundles[i].bundle_id,
+            .chunks = {
+                .length = cached_bundles[i].chunk_count,
+                .allocated_length = cached_bundles[i].chunk_count,
+                .objects = &bundle_chunks[cached_bundles[i].first_chunk]
+            }
+        };
+        add_object(&manifest->bundles, &bundle);
+    }
+
+    char* strings = section_of(index_cache, SECTION_STRINGS);
+    const struct cached_language* cached_languages = section_of(index_cache, SECTION_LANGUAGES);
+    initialize_list_size(&manifest->languages, max(header->language_count, (uint32_t) 1));
+    for (uint32_t i = 0; i < header->language_count; i++) {
+        Language language = {
+            .language_id = cached_languages[i].language_id,
+            .name = &strings[cached_languages[i].name]
+        };
+        add_object(&manifest->languages, &language);
+    }
+
+    initialize_list_size(&manifest->parameters, max(header->parameter_count, (uint32_t) 1));
+    add_objects(&manifest->parameters, (Parameters*) section_of(index_cache, SECTION_PARAMETERS), header->parameter_count);
+
+    initialize_list(&manifest->files);
+
+    return manifest;
+}
+
+void load_cached_files(Manifest* manifest, FileFilter filter, void* filter_data, Arena* arena)
+{
+    const struct index_cache* index_cache = manifest->index_cache;
+    const struct index_cache_header* header = (struct index_cache_header*) index_cache->data;
+    const struct cached_file* cached_files = section_of(index_cache, SECTION_FILES);
+    Chunk* file_chunks = section_of(index_cache, SECTION_FILE_CHUNKS);
+    char* strings = section_of(index_cache, SECTION_STRINGS);
+    Language languages[64];
+
+    for (uint32_t i = 0; i < header->file_count; i++) {
+        const struct cached_file* cached_file = &cached_files[i];
+        File new_file = {
+            .name = &strings[cached_file->name],
+            .link = &strings[cached_file->link],
+            .languages = {.allocated_length = 64, .objects = languages},
+            .file_size = cached_file->file_size,
+            .chunks = {
+                .length = cached_file->chunk_count,
+                .allocated_length = cached_file->chunk_count,
+                .objects = &file_chunks[cached_file->first_chunk]
+            }
+        };
+        for (int j = 0; j < 64; j++) {
+            if (cached_file->language_mask & (1ull << j)) {
+                Language* language = NULL;
+                find_object_s(&manifest->languages, language, language_id, j + 1);
+                add_object(&new_file.languages, language);
+            }
+        }
+        if (filter && !filter(&new_file, filter_data))
+            continue;
+
+        new_file.languages.objects = arena_alloc(arena, new_file.languages.length * sizeof(Language));
+        memcpy(new_file.languages.objects, languages, new_file.languages.length * sizeof(Language));
+        new_file.languages.allocated_length = new_file.languages.length;
+        add_object(&manifest->files, &new_file);
+    }
+}
+
+void close_index_cache(struct index_cache* index_cache)
+{
+#ifndef _WIN32
+    munmap(index_cache->data, index_cache->size);
+#else
+    free(index_cache->data);
+#endif
+    free(index_cache);
+}
+
+struct cache_writer {
+    FILE* file;
+    uint64_t position;
+    bool failed;
+};
+
+static void write_data(struct cache_writer* writer, const void* data, uint64_t size)
+{
+    if (size && fwrite(data, size, 1, writer->file) != 1)
+        writer->failed = true;
+    writer->position += size;
+}
+
+// pads the file to the next section boundary and returns the offset the section starts at
+static uint64_t begin_section(struct cache_writer* writer)
+{
+    static const uint8_t padding[SECTION_ALIGNMENT];
+    write_data(writer, padding, -writer->position % SECTION_ALIGNMENT);
+    return writer->position;
+}
+
+static uint64_t add_string(uint64_t* strings_size, const char* string)
+{
+    if (!*string)
+        return 0;
+    uint64_t offset = *strings_size;
+    *strings_size += strlen(string) + 1;
+    return offset;
+}
+
+// rename doesn't replace existing files on Windows, and a stale cache file is exactly what gets replaced here
+static bool replace_file(const char* source, const char* target)
+{
+#ifdef _WIN32
+    return MoveFileExA(source, target, MOVEFILE_REPLACE_EXISTING);
+#else
+    return rename(source, target) == 0;
+#endif
+}
+
+bool write_index_cache(const char* cache_dir, Manifest* manifest)
+{
+    // the files are only needed until they're written, so they don't stay in the manifest's arena for the whole run
+    Arena files_arena;
+    initialize_arena(&files_arena, 1024 * 1024);
+    uint32_t first_file = manifest->files.length;
+    load_files_in(manifest, NULL, NULL, &files_arena);
+    File* files = &manifest->files.objects[first_file];
+    uint32_t file_count = manifest->files.length - first_file;
+
+    struct index_cache_header header = {
+        .magic = "RMIX",
+        .version = INDEX_CACHE_VERSION,
+        .manifest_id = manifest->manifest_id,
+        .record_sizes = RECORD_SIZES,
+        .bundle_count = manifest->bundles.length,
+        .chunk_count = manifest->chunks.length,
+        .language_count = manifest->languages.length,
+        .parameter_count = manifest->parameters.length,
+        .file_count = file_count,
+        .chunk_index_mask = manifest->chunk_index.mask,
+        .chunk_index_shift = manifest->chunk_index.shift,
+        .strings_size = 1
+    };
+
+    // the string section is written last, so the offsets of all strings can be assigned while building the records
+    struct cached_bundle* cached_bundles = malloc(max(header.bundle_count, (uint32_t) 1) * sizeof(struct cached_bundle));
+    uint32_t first_chunk = 0;
+    for (uint32_t i = 0; i < manifest->bundles.length; i++) {
+        cached_bundles[i] = (struct cached_bundle) {
+            .bundle_id = manifest->bundles.objects[i].bundle_id,
+            .first_chunk = first_chunk,
+            .chunk_count = manifest->bundles.objects[i].chunks.length
+        };
+        first_chunk += manifest->bundles.objects[i].chunks.length;
+    }
+    struct cached_language* cached_languages = malloc(max(header.language_count, (uint32_t) 1) * sizeof(struct cached_language));
+    for (uint32_t i = 0; i < manifest->languages.length; i++) {
+        cached_languages[i] = (struct cached_language) {
+            .name = add_string(&header.strings_size, manifest->languages.objects[i].name),
+            .language_id = manifest->languages.objects[i].language_id
+        };
+    }
+    struct cached_file* cached_files = malloc(max(file_count, (uint32_t) 1) * sizeof(struct cached_file));
+    for (uint32_t i = 0; i < file_count; i++) {
+        cached_files[i] = (struct cached_file) {
+            .name = add_string(&header.strings_size, files[i].name),
+            .link = add_string(&header.strings_size, files[i].link),
+            .file_size = files[i].file_size,
+            .first_chunk = header.file_chunk_count,
+            .chunk_count = files[i].chunks.length
+        };
+        for (uint32_t j = 0; j < files[i].languages.length; j++) {
+            cached_files[i].language_mask |= 1ull << (files[i].languages.objects[j].language_id - 1);
+        }
+        header.file_chunk_count += files[i].chunks.length;
+    }
+
+    // written to a temporary file first, so that concurrent runs never see a partially written cache file
+    char* path = cache_file_path(cache_dir, manifest->manifest_id);
+    char* temporary_path = malloc(strlen(path) + 16);
+    sprintf(temporary_path, "%s.%d", path, (int) getpid());
+    struct cache_writer writer = {.file = fopen(temporary_path, "wb")};
+    if (!writer.file) {
+        eprintf("Warning: Couldn't create index cache file \"%s\".\n", temporary_path);
+        writer.failed = true;
+        goto cleanup;
+    }
+
+    write_data(&writer, &header, sizeof(header));
+    header.offsets[SECTION_BUNDLES] = begin_section(&writer);
+    write_data(&writer, cached_bundles, header.bundle_count * sizeof(struct cached_bundle));
+    header.offsets[SECTION_BUNDLE_CHUNKS] = begin_section(&writer);
+    for (uint32_t i = 0; i < manifest->bundles.length; i++) {
+        write_data(&writer, manifest->bundles.objects[i].chunks.objects, manifest->bundles.objects[i].chunks.length * sizeof(Chunk));
+    }
+    header.offsets[SECTION_CHUNKS] = begin_section(&writer);
+    write_data(&writer, manifest->chunks.objects, header.chunk_count * sizeof(Chunk));
+    header.offsets[SECTION_CHUNK_INDEX] = begin_section(&writer);
+    write_data(&writer, manifest->chunk_index.slots, ((uint64_t) header.chunk_index_mask + 1) * sizeof(struct hash_index_slot));
+    header.offsets[SECTION_LANGUAGES] = begin_section(&writer);
+    write_data(&writer, cached_languages, header.language_count * sizeof(struct cached_language));
+    header.offsets[SECTION_PARAMETERS] = begin_section(&writer);
+    write_data(&writer, manifest->parameters.objects, header.parameter_count * sizeof(Parameters));
+    header.offsets[SECTION_FILES] = begin_section(&writer);
+    write_data(&writer, cached_files, file_count * sizeof(struct cached_file));
+    header.offsets[SECTION_FILE_CHUNKS] = begin_section(&writer);
+    for (uint32_t i = 0; i < file_count; i++) {
+        write_data(&writer, files[i].chunks.objects, files[i].chunks.length * sizeof(Chunk));
+    }
+    header.offsets[SECTION_STRINGS] = begin_section(&writer);
+    write_data(&writer, "", 1);
+    for (uint32_t i = 0; i < manifest->languages.length; i++) {
+        if (*manifest->languages.objects[i].name)
+            write_data(&writer, manifest->languages.objects[i].name, strlen(manifest->languages.objects[i].name) + 1);
+    }
+    for (uint32_t i = 0; i < file_count; i++) {
+        if (*files[i].name)
+            write_data(&writer, files[i].name, strlen(files[i].name) + 1);
+        if (*files[i].link)
+            write_data(&writer, files[i].link, strlen(files[i].link) + 1);
+    }
+    // now that all offsets are known, fill in the header
+    if (fseeko(writer.file, 0, SEEK_SET) == 0)
+        write_data(&writer, &header, sizeof(header));
+    else
+        writer.failed = true;
+
+    if (fclose(writer.file) != 0)
+        writer.failed = true;
+    if (writer.failed || !replace_file(temporary_path, path)) {
+        eprintf("Warning: Couldn't write index cache file \"%s\".\n", path);
+        remove(temporary_path);
+        writer.failed = true;
+    } else {
+        v_printf(1, "Info: Wrote index cache file \"%s\".\n", path);
+    }
+
+cleanup:
+    free(temporary_path);
+    free(path);
+    free(cached_files);
+    free(cached_languages);
+    free(cached_bundles);
+    manifest->files.length = first_file;
+    free_arena(&files_arena);
+
+    return !writer.failed;
+}
@@ -0,0 +1,24 @@
+#ifndef INDEX_CACHE_H
+#define INDEX_CACHE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "rman.h"
+
+// On-disk cache of parsed manifests, one file per manifest_id inside a cache directory. A cache file holds the
+// resolved manifest (bundles, chunks, chunk index, languages and all files with their paths and chunk lists) as
+// position-independent tables, so loading one is a single mmap without decompressing or parsing anything.
+
+// returns the manifest cached for manifest_id in cache_dir, or NULL if there is no (valid) cache file for it
+Manifest* open_index_cache(const char* cache_dir, uint64_t manifest_id);
+
+// writes manifest to cache_dir; all files of the manifest get loaded for this, but manifest->files is left as is
+bool write_index_cache(const char* cache_dir, Manifest* manifest);
+
+// load_files for manifests opened with open_index_cache
+void load_cached_files(Manifest* manifest, FileFilter filter, void* filter_data, Arena* arena);
+
+void close_index_cache(struct index_cache* index_cache);
+
+#endif
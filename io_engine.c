@@ -0,0 +1,268 @@
+#define _FILE_OFFSET_BITS 64
+#ifdef _WIN32
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <sys/uio.h>
+#endif
+#ifdef __linux__
+    #include <sys/syscall.h>
+    #include <sys/mman.h>
+    #include <linux/io_uring.h>
+    #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+        #define HAS_IO_URING
+    #endif
+#endif
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "defs.h"
+#include "io_engine.h"
+#include "list.h"
+
+// requests submitted at once, more are split into several rounds
+#define IO_RING_ENTRIES 64
+
+
+// drops the first length bytes of vectors
+static void advance_vectors(struct iovec** vectors, uint32_t* vector_count, uint64_t length)
+{
+    while (*vector_count > 0 && length >= (*vectors)->iov_len) {
+        length -= (*vectors)->iov_len;
+        (*vectors)++;
+        (*vector_count)--;
+    }
+    if (*vector_count > 0) {
+        (*vectors)->iov_base = (uint8_t*) (*vectors)->iov_base + length;
+        (*vectors)->iov_len -= length;
+    }
+}
+
+// Transfers all of vectors (which describe contiguous file data) at offset, resuming after short transfers. Returns
+// 0, or the error that stopped it (EIO if a read hit the end of the file).
+static int transfer_vectors(int fd, uint64_t offset, struct iovec* vectors, uint32_t vector_count, bool write)
+{
+#ifndef _WIN32
+    while (vector_count > 0) {
+        ssize_t transferred = write ? pwritev(fd, vectors, vector_count, offset) : preadv(fd, vectors, vector_count, offset);
+        if (transferred == -1 && errno == EINTR)
+            continue;
+        if (transferred == -1)
+            return errno;
+        // reading nothing means the file ended
+        if (transferred == 0)
+            return EIO;
+        offset += transferred;
+        advance_vectors(&vectors, &vector_count, transferred);
+    }
+#else
+    // no vectored i/o to arbitrary memory on windows (ReadFileScatter wants whole pages), so it's one call per buffer
+    for (; vector_count > 0; vectors++, vector_count--) {
+        uint8_t* position = vectors->iov_base;
+        size_t length = vectors->iov_len;
+        while (length > 0) {
+            OVERLAPPED overlapped = {.Offset = (DWORD) offset, .OffsetHigh = (DWORD) (offset >> 32)};
+            DWORD transferred;
+            HANDLE file = (HANDLE) _get_osfhandle(fd);
+            if (!(write ? WriteFile(file, position, min(length, (size_t) 1 << 30), &transferred, &overlapped)
+                : ReadFile(file, position, min(length, (size_t) 1 << 30), &transferred, &overlapped)) || transferred == 0)
+                return EIO;
+            position += transferred;
+            offset += transferred;
+            length -= transferred;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+void initialize_io_engine(IoEngine* io, bool use_io_uring)
+{
+    initialize_list(&io->requests);
+    initialize_list(&io->vectors);
+    io->ring_fd = -1;
+#ifdef HAS_IO_URING
+    if (!use_io_uring)
+        return;
+    // raw system calls rather than liburing, the few parts of it needed here aren't worth another dependency
+    struct io_uring_params params = {0};
+    int ring_fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ring_fd == -1)
+        return;
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        io->sq_ring_size = io->cq_ring_size = max(io->sq_ring_size, io->cq_ring_size);
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    io->cq_ring = single_mmap ? io->sq_ring
+        : mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    io->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqes != MAP_FAILED)
+            munmap(io->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        if (!single_mmap && io->cq_ring != MAP_FAILED)
+            munmap(io->cq_ring, io->cq_ring_size);
+        if (io->sq_ring != MAP_FAILED)
+            munmap(io->sq_ring, io->sq_ring_size);
+        close(ring_fd);
+        return;
+    }
+    io->ring_fd = ring_fd;
+    io->ring_entries = params.sq_entries;
+    io->sq_tail = (uint32_t*) ((uint8_t*) io->sq_ring + params.sq_off.tail);
+    io->sq_mask = (uint32_t*) ((uint8_t*) io->sq_ring + params.sq_off.ring_mask);
+    io->sq_array = (uint32_t*) ((uint8_t*) io->sq_ring + params.sq_off.array);
+    io->cq_head = (uint32_t*) ((uint8_t*) io->cq_ring + params.cq_off.head);
+    io->cq_tail = (uint32_t*) ((uint8_t*) io->cq_ring + params.cq_off.tail);
+    io->cq_mask = (uint32_t*) ((uint8_t*) io->cq_ring + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*) ((uint8_t*) io->cq_ring + params.cq_off.cqes);
+#else
+    (void) use_io_uring;
+#endif
+}
+
+void add_io_request(IoEngine* io, int fd, uint64_t offset)
+{
+    add_object(&io->requests, (&(IoRequest) {.fd = fd, .offset = offset, .first_vector = io->vectors.length}));
+}
+
+void add_io_vector(IoEngine* io, void* data, size_t length)
+{
+    IoRequest* request = &io->requests.objects[io->requests.length - 1];
+    if (request->vector_count == IOV_MAX) {
+        add_io_request(io, request->fd, request->offset + request->length);
+        request = &io->requests.objects[io->requests.length - 1];
+    }
+    add_object(&io->vectors, (&(struct iovec) {.iov_base = data, .iov_len = length}));
+    request->length += length;
+    request->vector_count++;
+}
+
+#ifdef HAS_IO_URING
+// Waits for the completions of outstanding requests that were submitted already and drops them, so that none of them
+// is still running on the caller's buffers once run_ring gave up.
+static void drain_ring(IoEngine* io, uint32_t outstanding)
+{
+    while (1) {
+        uint32_t head = *io->cq_head;
+        uint32_t completion_tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        outstanding -= completion_tail - head;
+        __atomic_store_n(io->cq_head, completion_tail, __ATOMIC_RELEASE);
+        if (outstanding == 0)
+            return;
+        int entered = syscall(__NR_io_uring_enter, io->ring_fd, 0, outstanding, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (entered == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return;
+    }
+}
+
+// submits all requests to the ring and waits for them, a round of ring_entries at a time
+static bool run_ring(IoEngine* io, bool write)
+{
+    int error = 0;
+    for (uint32_t start = 0; start < io->requests.length; start += io->ring_entries) {
+        uint32_t count = min(io->requests.length - start, io->ring_entries);
+        uint32_t tail = *io->sq_tail;
+        for (uint32_t i = 0; i < count; i++) {
+            IoRequest* request = &io->requests.objects[start + i];
+            uint32_t index = tail & *io->sq_mask;
+            io->sqes[index] = (struct io_uring_sqe) {
+                .opcode = write ? IORING_OP_WRITEV : IORING_OP_READV,
+                .fd = request->fd,
+                .off = request->offset,
+                .addr = (uintptr_t) &io->vectors.objects[request->first_vector],
+                .len = request->vector_count,
+                .user_data = start + i
+            };
+            io->sq_array[index] = index;
+            tail++;
+        }
+        // the kernel may only see the new entries once they're filled in
+        __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+
+        uint32_t submitted = 0;
+        for (uint32_t completed = 0; completed < count;) {
+            int entered = syscall(__NR_io_uring_enter, io->ring_fd, count - submitted, count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (entered == -1) {
+                if (errno == EINTR)
+                    continue;
+                // the entries that weren't submitted are taken back, the ones that were have to finish first
+                error = errno;
+                __atomic_store_n(io->sq_tail, tail - (count - submitted), __ATOMIC_RELEASE);
+                drain_ring(io, submitted - completed);
+                errno = error;
+                return false;
+            }
+            submitted += entered;
+            uint32_t head = *io->cq_head;
+            uint32_t completion_tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != completion_tail; head++, completed++) {
+                struct io_uring_cqe* completion = &io->cqes[head & *io->cq_mask];
+                IoRequest* request = &io->requests.objects[completion->user_data];
+                int32_t result = completion->res;
+                if (result < 0 && result != -EINTR && result != -EAGAIN) {
+                    error = -result;
+                    continue;
+                }
+                // whatever is left of a short transfer is done without the ring
+                struct iovec* vectors = &io->vectors.objects[request->first_vector];
+                uint32_t vector_count = request->vector_count;
+                advance_vectors(&vectors, &vector_count, max(result, 0));
+                int transfer_error = transfer_vectors(request->fd, request->offset + max(result, 0), vectors, vector_count, write);
+                if (transfer_error)
+                    error = transfer_error;
+            }
+            __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    errno = error;
+    return error == 0;
+}
+#endif
+
+bool run_io(IoEngine* io, bool write)
+{
+    bool failed = false;
+#ifdef HAS_IO_URING
+    if (io->ring_fd != -1) {
+        failed = !run_ring(io, write);
+    } else
+#endif
+    {
+        int error = 0;
+        for (uint32_t i = 0; i < io->requests.length; i++) {
+            IoRequest* request = &io->requests.objects[i];
+            int request_error = transfer_vectors(request->fd, request->offset, &io->vectors.objects[request->first_vector], request->vector_count, write);
+            if (request_error)
+                error = request_error;
+        }
+        failed = error != 0;
+        if (failed)
+            errno = error;
+    }
+    io->requests.length = 0;
+    io->vectors.length = 0;
+
+    return !failed;
+}
+
+void free_io_engine(IoEngine* io)
+{
+#ifdef HAS_IO_URING
+    if (io->ring_fd != -1) {
+        munmap(io->sqes, io->ring_entries * sizeof(struct io_uring_sqe));
+        if (io->cq_ring != io->sq_ring)
+            munmap(io->cq_ring, io->cq_ring_size);
+        munmap(io->sq_ring, io->sq_ring_size);
+        close(io->ring_fd);
+    }
+#endif
+    free(io->requests.objects);
+    free(io->vectors.objects);
+}
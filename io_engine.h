@@ -0,0 +1,72 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#ifndef _WIN32
+    #include <sys/uio.h>
+#else
+    struct iovec {
+        void* iov_base;
+        size_t iov_len;
+    };
+#endif
+#include <limits.h>
+
+#include "list.h"
+
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
+// positional read or write of length bytes of a file, from or to vector_count buffers starting at first_vector
+typedef struct io_request {
+    int fd;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t first_vector;
+    uint32_t vector_count;
+} IoRequest;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Does batches of positional reads or writes. With io_uring (linux only, and only if asked for) all requests of a
+// batch are submitted and waited for with a single system call, otherwise they're done one after the other with
+// preadv / pwritev. Not thread-safe, every thread needs its own.
+typedef struct io_engine {
+    LIST(IoRequest) requests;
+    LIST(struct iovec) vectors;
+    int ring_fd; // -1 without io_uring
+    uint32_t ring_entries;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    struct io_uring_cqe* cqes;
+} IoEngine;
+
+// falls back to plain system calls if io_uring isn't wanted or can't be set up
+void initialize_io_engine(IoEngine* io, bool use_io_uring);
+
+// starts a request at offset of fd, its buffers are added with add_io_vector
+void add_io_request(IoEngine* io, int fd, uint64_t offset);
+
+// adds length bytes at data to the last request, or to a new one right after it if that has IOV_MAX buffers already
+void add_io_vector(IoEngine* io, void* data, size_t length);
+
+// Does all requests added since the last call, as reads or writes. Returns false (with errno set) if any of them
+// failed, or for reads, if a file ended early.
+bool run_io(IoEngine* io, bool write);
+
+void free_io_engine(IoEngine* io);
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "job_system.h"
+
+
+void initialize_job_system(JobSystem* jobs, int worker_count)
+{
+    jobs->worker_count = worker_count;
+    jobs->deques = malloc(worker_count * sizeof(JobDeque));
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_init(&jobs->deques[i].lock, NULL);
+        jobs->deques[i].capacity = 64;
+        jobs->deques[i].jobs = malloc(64 * sizeof(Job));
+        jobs->deques[i].top = 0;
+        jobs->deques[i].bottom = 0;
+    }
+    atomic_init(&jobs->pending_jobs, 0);
+    atomic_init(&jobs->pushed_jobs, 0);
+    atomic_init(&jobs->stolen_jobs, 0);
+    pthread_mutex_init(&jobs->wait_lock, NULL);
+    pthread_cond_init(&jobs->job_added, NULL);
+    atomic_init(&jobs->generation, 0);
+}
+
+// wakes waiting workers, all of them or just one for a single new job
+static void wake_workers(JobSystem* jobs, bool all)
+{
+    pthread_mutex_lock(&jobs->wait_lock);
+    atomic_fetch_add(&jobs->generation, 1);
+    if (all)
+        pthread_cond_broadcast(&jobs->job_added);
+    else
+        pthread_cond_signal(&jobs->job_added);
+    pthread_mutex_unlock(&jobs->wait_lock);
+}
+
+void push_job(JobSystem* jobs, int worker, Job job)
+{
+    JobDeque* deque = &jobs->deques[worker];
+    // counted before the job becomes visible, so that nobody can see it finished before it's pending
+    atomic_fetch_add(&jobs->pending_jobs, 1);
+    atomic_fetch_add(&jobs->pushed_jobs, 1);
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity) {
+        // top and bottom only ever grow, so the ring buffer has to be unwrapped into the new one
+        Job* new_jobs = malloc(2 * deque->capacity * sizeof(Job));
+        for (uint32_t i = deque->top; i != deque->bottom; i++) {
+            new_jobs[i & (2 * deque->capacity - 1)] = deque->jobs[i & (deque->capacity - 1)];
+        }
+        free(deque->jobs);
+        deque->jobs = new_jobs;
+        deque->capacity *= 2;
+    }
+    deque->jobs[deque->bottom & (deque->capacity - 1)] = job;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+    wake_workers(jobs, false);
+}
+
+static bool pop_job(JobDeque* deque, Job* job)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom != deque->top;
+    if (found) {
+        deque->bottom--;
+        *job = deque->jobs[deque->bottom & (deque->capacity - 1)];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+static bool steal_job(JobDeque* deque, Job* job)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom != deque->top;
+    if (found) {
+        *job = deque->jobs[deque->top & (deque->capacity - 1)];
+        deque->top++;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+bool take_job(JobSystem* jobs, int worker, Job* job)
+{
+    while (1) {
+        // read before looking for jobs, so that anything pushed after that shows up as a new generation
+        uint_fast64_t generation = atomic_load(&jobs->generation);
+        if (pop_job(&jobs->deques[worker], job))
+            return true;
+        for (int i = 1; i < jobs->worker_count; i++) {
+            if (steal_job(&jobs->deques[(worker + i) % jobs->worker_count], job)) {
+                atomic_fetch_add(&jobs->stolen_jobs, 1);
+                return true;
+            }
+        }
+        if (atomic_load(&jobs->pending_jobs) == 0)
+            return false;
+        // the jobs still running might push more
+        pthread_mutex_lock(&jobs->wait_lock);
+        if (atomic_load(&jobs->generation) == generation && atomic_load(&jobs->pending_jobs) != 0)
+            pthread_cond_wait(&jobs->job_added, &jobs->wait_lock);
+        pthread_mutex_unlock(&jobs->wait_lock);
+    }
+}
+
+void finish_job(JobSystem* jobs)
+{
+    if (atomic_fetch_sub(&jobs->pending_jobs, 1) == 1)
+        wake_workers(jobs, true);
+}
+
+void hold_jobs(JobSystem* jobs)
+{
+    atomic_fetch_add(&jobs->pending_jobs, 1);
+}
+
+void free_job_system(JobSystem* jobs)
+{
+    for (int i = 0; i < jobs->worker_count; i++) {
+        pthread_mutex_destroy(&jobs->deques[i].lock);
+        free(jobs->deques[i].jobs);
+    }
+    free(jobs->deques);
+    pthread_cond_destroy(&jobs->job_added);
+    pthread_mutex_destroy(&jobs->wait_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// a unit of work, usually count items starting at start of the index-th element of something
+typedef struct job {
+    uint32_t index;
+    uint32_t start;
+    uint32_t count;
+    uint32_t list; // which of several lists of somethings, for workers that take jobs of more than one
+} Job;
+
+typedef struct job_deque {
+    pthread_mutex_t lock;
+    Job* jobs; // ring buffer of capacity slots (a power of two)
+    uint32_t capacity;
+    uint32_t top; // next job to steal
+    uint32_t bottom; // one past the job the owner takes next
+} JobDeque;
+
+// Work-stealing job queues for a fixed set of workers: every worker takes the jobs it pushed itself newest first,
+// and once it runs out steals the oldest ones of the others. Jobs may push further jobs (for example by splitting
+// themselves), so workers only stop once all jobs are finished, not just taken.
+typedef struct job_system {
+    int worker_count;
+    JobDeque* deques;
+    atomic_uint_fast64_t pending_jobs; // pushed but not finished yet
+    atomic_uint_fast64_t pushed_jobs;
+    atomic_uint_fast64_t stolen_jobs;
+    // workers without anything to take sleep on job_added until a job is pushed or the last one finishes, both of
+    // which bump generation
+    pthread_mutex_t wait_lock;
+    pthread_cond_t job_added;
+    atomic_uint_fast64_t generation;
+} JobSystem;
+
+void initialize_job_system(JobSystem* jobs, int worker_count);
+
+// adds job to the queue of worker
+void push_job(JobSystem* jobs, int worker, Job job);
+
+// Gets the next job for worker, waiting for other workers if there's nothing to take yet but not all jobs are
+// finished. Returns false once all jobs are finished. Every job taken has to be marked done with finish_job.
+bool take_job(JobSystem* jobs, int worker, Job* job);
+
+void finish_job(JobSystem* jobs);
+
+// Keeps take_job from returning false while there's nothing pending, for as long as jobs may still be pushed from
+// outside the workers. The hold is released with finish_job, like a job.
+void hold_jobs(JobSystem* jobs);
+
+void free_job_system(JobSystem* jobs);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include "defs.h"
 
 #define LIST(type) struct { \
@@ -137,6 +139,67 @@
     } \
 } while (0)
 
+typedef struct sort_pair {
+    uint64_t key;
+    uint32_t index;
+} SortPair;
+
+// stable LSD radix sort of (key, index) pairs by key, one byte per pass.
+// Passes in which all keys share the same byte are skipped.
+static inline void radix_sort_pairs(SortPair* pairs, uint32_t length)
+{
+    uint32_t histograms[8][256] = {{0}};
+    for (uint32_t i = 0; i < length; i++) {
+        for (int byte = 0; byte < 8; byte++)
+            histograms[byte][(pairs[i].key >> (8 * byte)) & 0xFF]++;
+    }
+
+    SortPair* temp = malloc(max(length, (uint32_t) 1) * sizeof(SortPair));
+    SortPair* from = pairs, *to = temp;
+    for (int byte = 0; byte < 8; byte++) {
+        uint32_t* histogram = histograms[byte];
+        uint32_t position = 0;
+        bool trivial = false;
+        for (int digit = 0; digit < 256; digit++) {
+            if (histogram[digit] == length) {
+                trivial = true;
+                break;
+            }
+            uint32_t count = histogram[digit];
+            histogram[digit] = position;
+            position += count;
+        }
+        if (trivial)
+            continue;
+
+        for (uint32_t i = 0; i < length; i++) {
+            to[histogram[(from[i].key >> (8 * byte)) & 0xFF]++] = from[i];
+        }
+        SortPair* swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != pairs)
+        memcpy(pairs, from, length * sizeof(SortPair));
+    free(temp);
+}
+
+// sorts a list by a uint64_t (or narrower unsigned) key: radix sorts (key, index) pairs, then permutes the objects once
+#define radix_sort_list(list, key) do { \
+    SortPair* ___pairs = malloc(max((list)->length, (uint32_t) 1) * sizeof(SortPair)); \
+    for (uint32_t ___i = 0; ___i < (list)->length; ___i++) { \
+        ___pairs[___i] = (SortPair) {(list)->objects[___i].key, ___i}; \
+    } \
+    radix_sort_pairs(___pairs, (list)->length); \
+    __typeof__((list)->objects) ___sorted = malloc(max((list)->allocated_length, (uint32_t) 1) * sizeof((list)->objects[0])); \
+    for (uint32_t ___i = 0; ___i < (list)->length; ___i++) { \
+        ___sorted[___i] = (list)->objects[___pairs[___i].index]; \
+    } \
+    free(___pairs); \
+    free((list)->objects); \
+    (list)->objects = ___sorted; \
+} while (0)
+
 typedef LIST(uint8_t) uint8_list;
 typedef LIST(uint16_t) uint16_list;
 typedef LIST(uint32_t) uint32_list;
@@ -17,7 +17,9 @@
 #include "defs.h"
 #include "download.h"
 #include "general_utils.h"
+#include "index_cache.h"
 #include "list.h"
+#include "patch.h"
 #include "socket_utils.h"
 #include "rman.h"
 
@@ -60,12 +62,85 @@ void print_manifest(Manifest* manifest, char* output_path)
     fprintf(output_file, "]\n}\n");
 }
 
+struct filter_data {
+    pcre2_code* pattern;
+    pcre2_code* antipattern;
+    pcre2_match_data* match_data;
+    char** langs;
+    bool download_locales;
+    bool download_neutrals;
+};
+
+bool file_matches(const File* file, void* _data)
+{
+    struct filter_data* data = _data;
+    if (!data->download_locales && file->languages.length != 0)
+        return false;
+    if (pcre2_match(data->pattern, (PCRE2_SPTR) file->name, PCRE2_ZERO_TERMINATED, 0, 0, data->match_data, NULL) >= 0 && pcre2_match(data->antipattern, (PCRE2_SPTR) file->name, PCRE2_ZERO_TERMINATED, 0, PCRE2_NOTEMPTY, data->match_data, NULL) < 0) {
+        if (!data->langs[0] || (data->download_neutrals && file->languages.length == 0)) {
+            return true;
+        } else {
+            for (uint32_t j = 0; j < file->languages.length; j++) {
+                for (uint32_t k = 0; data->langs[k]; k++) {
+                    if (strcasecmp(file->languages.objects[j].name, data->langs[k]) == 0)
+                        return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+// opens the manifest at manifest_path (a file path or a url), going through the index cache if one is used
+Manifest* open_manifest(char* manifest_path, char* index_cache_path)
+{
+    Manifest* manifest = NULL;
+    uint64_t manifest_id;
+    if (access(manifest_path, F_OK) == 0) {
+        if (index_cache_path && read_manifest_id(manifest_path, &manifest_id))
+            manifest = open_index_cache(index_cache_path, manifest_id);
+        if (!manifest)
+            manifest = parse_manifest(manifest_path);
+    } else {
+        v_printf(1, "Info: Assuming \"%s\" is a url.\n", manifest_path);
+        HttpResponse* data = download_url(manifest_path);
+        if (!data) {
+            eprintf("Make sure \"%s\" is a valid path to a manifest file or a valid url.\n", manifest_path);
+            return NULL;
+        } else if (data->status_code >= 400) {
+            eprintf("Error: Got a %d response.\n", data->status_code);
+            return NULL;
+        }
+        if (index_cache_path && data->length >= 28 && strncmp((char*) data->data, "RMAN", 4) == 0)
+            manifest = open_index_cache(index_cache_path, to_(uint64_t, data->data + 16));
+        if (!manifest)
+            manifest = parse_manifest(data->data);
+        free(data->data);
+        free(data);
+    }
+    if (manifest && index_cache_path && !manifest->index_cache) {
+        if (create_dirs(index_cache_path, true) == -1)
+            eprintf("Warning: Couldn't create index cache directory \"%s\".\n", index_cache_path);
+        else
+            write_index_cache(index_cache_path, manifest);
+    }
+
+    return manifest;
+}
+
 void print_help(void)
 {
     printf("ManifestDownloader - a tool to download League of Legends (and other Riot Games games') files.\n\n");
     printf("Options: \n");
     printf("  [--print-manifest [path]]\n    Just print an overview of the manifest's contents in json form, but don't download anything.\n    Provide an optional path parameter for the output file. Default is \"(manifest_id).json\"\n\n");
     printf("  [-t|--threads] amount\n    Specify amount of download-threads. Default is 1.\n\n");
+    printf("  [--decompress-threads] amount\n    Specify amount of threads decompressing downloaded chunks. Default is the amount of download-threads.\n\n");
+    printf("  [--write-threads] amount\n    Specify amount of threads writing decompressed chunks to disk. Default is 1.\n\n");
+    printf("  [--io-uring]\n    Read bundles from disk and write files through io_uring (Linux only), saving most system calls.\n    Falls back to normal reads and writes if the system doesn't support it.\n\n");
+    printf("  [--sparse]\n    Leave chunks that are all zeroes as holes in the files instead of writing them, where the file system supports it.\n    Saves writes and disk space on files with lots of padding.\n\n");
+    printf("  [--direct-io]\n    Write files with direct I/O (O_DIRECT, Linux only), so that a large install doesn't push everything else\n    out of the page cache. Only the partial blocks at the edges of each write go through the cache.\n\n");
+    printf("  [--mmap-output]\n    Decompress chunks straight into memory mappings of the output files (not on Windows), without write calls.\n    --sparse and --direct-io have no effect then.\n\n");
     printf("  [-o|--output] path\n    Specify output path. Default is \"output\".\n\n");
     printf("  [-f|--filter] filter\n    Download only files whose full name matches \"filter\".\n\n");
     printf("  [-u|--unfilter] unfilter\n    Download only files whose full name does not match \"unfilter\".\n\n    Note: Both -f and -u options use case-independent regex-matching.\n\n");
@@ -75,6 +150,8 @@ void print_help(void)
     printf("  [--verify-only]\n    Check files only and print results, but don't update files on disk.\n\n");
     printf("  [--existing-only]\n    Only operate on existing files. Non-existent files are ignored / not created.\n\n");
     printf("  [--skip-existing]\n    By default, all existing files are verified and overwritten if they aren't correct.\n    By specifying this flag existing files will not be checked if their file size matches the expected one.\n\n");
+    printf("  [--old-manifest] url_or_path\n    Update an install of this (older) manifest in the output path: files that didn't change aren't read at all,\n    chunks that are still present in the install are copied from there and only new chunks get downloaded.\n\n");
+    printf("  [--index-cache] path\n    Keep the parsed contents of each manifest in this directory, so that later runs on the same manifest\n    don't have to decompress and parse it again.\n\n");
     printf("  [-v [-v ...]]\n    Increases verbosity level by one per \"-v\".\n");
 }
 
@@ -114,12 +191,38 @@ int main(int argc, char* argv[])
     bool verify_only = false;
     bool skip_existing = false;
     bool existing_only = false;
+    char* index_cache_path = NULL;
+    char* old_manifest_path = NULL;
+    int decompress_threads = 0;
+    int write_threads = 0;
+    bool io_uring = false;
+    bool sparse = false;
+    bool direct_io = false;
+    bool mmap_output = false;
     for (char** arg = &argv[2]; *arg; arg++) {
         if (strcmp(*arg, "-t") == 0 || strcmp(*arg, "--threads") == 0) {
             if (*(arg + 1)) {
                 arg++;
                 amount_of_threads = max(strtol(*arg, NULL, 10), 1);
             }
+        } else if (strcmp(*arg, "--decompress-threads") == 0) {
+            if (*(arg + 1)) {
+                arg++;
+                decompress_threads = max(strtol(*arg, NULL, 10), 1);
+            }
+        } else if (strcmp(*arg, "--write-threads") == 0) {
+            if (*(arg + 1)) {
+                arg++;
+                write_threads = max(strtol(*arg, NULL, 10), 1);
+            }
+        } else if (strcmp(*arg, "--io-uring") == 0) {
+            io_uring = true;
+        } else if (strcmp(*arg, "--sparse") == 0) {
+            sparse = true;
+        } else if (strcmp(*arg, "--direct-io") == 0) {
+            direct_io = true;
+        } else if (strcmp(*arg, "--mmap-output") == 0) {
+            mmap_output = true;
         } else if (strcmp(*arg, "-o") == 0 || strcmp(*arg, "--output") == 0) {
             if (*(arg + 1)) {
                 arg++;
@@ -167,6 +270,16 @@ int main(int argc, char* argv[])
                 arg++;
                 print_manifest_path = *arg;
             }
+        } else if (strcmp(*arg, "--old-manifest") == 0) {
+            if (*(arg + 1)) {
+                arg++;
+                old_manifest_path = *arg;
+            }
+        } else if (strcmp(*arg, "--index-cache") == 0) {
+            if (*(arg + 1)) {
+                arg++;
+                index_cache_path = *arg;
+            }
         } else if (strcmp(*arg, "-v") == 0) {
             VERBOSE++;
         }
@@ -181,28 +294,14 @@ int main(int argc, char* argv[])
     for (int i = 0; langs[i]; i++) {
         v_printf(1, "langs[%d]: %s\n", i, langs[i]);
     }
+    if (old_manifest_path)
+        v_printf(1, "Old manifest: %s\n", old_manifest_path);
     v_printf(1, "Downloading languages: %s\n", download_locales ? "true" : "false");
     v_printf(1, "Downloading language-neutral files: %s\n", download_neutrals || langs_length == 0 ? "true" : "false");
 
     char* manifestPath = argv[1];
 
-    Manifest* parsed_manifest;
-    if (access(manifestPath, F_OK) == 0) {
-        parsed_manifest = parse_manifest(manifestPath);
-    } else {
-        v_printf(1, "Info: Assuming \"%s\" is a url.\n", manifestPath);
-        HttpResponse* data = download_url(manifestPath);
-        if (!data) {
-            eprintf("Make sure the first argument is a valid path to a manifest file or a valid url.\n");
-            exit(EXIT_FAILURE);
-        } else if (data->status_code >= 400) {
-            eprintf("Error: Got a %d response.\n", data->status_code);
-            exit(EXIT_FAILURE);
-        }
-        parsed_manifest = parse_manifest(data->data);
-        free(data->data);
-        free(data);
-    }
+    Manifest* parsed_manifest = open_manifest(manifestPath, index_cache_path);
     if (!parsed_manifest) {
         exit(EXIT_FAILURE);
     }
@@ -212,62 +311,65 @@ int main(int argc, char* argv[])
             sprintf(print_manifest_path, "%016"PRIX64".json", parsed_manifest->manifest_id);
         }
         printf("Printing manifest info to \"%s\"...\n", print_manifest_path);
+        load_files(parsed_manifest, NULL, NULL);
         print_manifest(parsed_manifest, print_manifest_path);
         exit(EXIT_SUCCESS);
     }
 
-    FileList to_download;
-    initialize_list(&to_download);
-    pcre2_code* pattern = pcre2_compile((PCRE2_SPTR) filter, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &(int) {0}, &(size_t) {0}, NULL);
-    pcre2_code* antipattern = pcre2_compile((PCRE2_SPTR) unfilter, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &(int) {0}, &(size_t) {0}, NULL);
-    pcre2_match_data* match_data = pcre2_match_data_create(0, NULL);
-    for (uint32_t i = 0; i < parsed_manifest->files.length; i++) {
-        if (!download_locales && parsed_manifest->files.objects[i].languages.length != 0)
-            continue;
-        bool matches = false;
-        if (pcre2_match(pattern, (PCRE2_SPTR) parsed_manifest->files.objects[i].name, PCRE2_ZERO_TERMINATED, 0, 0, match_data, NULL) >= 0 && pcre2_match(antipattern, (PCRE2_SPTR) parsed_manifest->files.objects[i].name, PCRE2_ZERO_TERMINATED, 0, PCRE2_NOTEMPTY, match_data, NULL) < 0) {
-            if (!langs[0] || (download_neutrals && parsed_manifest->files.objects[i].languages.length == 0)) {
-                matches = true;
-            } else {
-                for (uint32_t j = 0; j < parsed_manifest->files.objects[i].languages.length; j++) {
-                    for (uint32_t k = 0; langs[k]; k++) {
-                        if (strcasecmp(parsed_manifest->files.objects[i].languages.objects[j].name, langs[k]) == 0)
-                            matches = true;
-                    }
-                }
-            }
-        }
-        if (matches)
-            add_object(&to_download, &parsed_manifest->files.objects[i]);
-    }
-    pcre2_match_data_free(match_data);
-    pcre2_code_free(pattern);
-    pcre2_code_free(antipattern);
+    struct filter_data filter_data = {
+        .pattern = pcre2_compile((PCRE2_SPTR) filter, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &(int) {0}, &(size_t) {0}, NULL),
+        .antipattern = pcre2_compile((PCRE2_SPTR) unfilter, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &(int) {0}, &(size_t) {0}, NULL),
+        .match_data = pcre2_match_data_create(0, NULL),
+        .langs = langs,
+        .download_locales = download_locales,
+        .download_neutrals = download_neutrals
+    };
+    load_files(parsed_manifest, file_matches, &filter_data);
+    pcre2_match_data_free(filter_data.match_data);
+    pcre2_code_free(filter_data.pattern);
+    pcre2_code_free(filter_data.antipattern);
+    FileList* to_download = &parsed_manifest->files;
 
     if (!verify_only) {
         v_printf(2, "To download:\n");
-        for (uint32_t i = 0; i < to_download.length; i++) {
-            v_printf(2, "\"%s\"\n", to_download.objects[i].name);
+        for (uint32_t i = 0; i < to_download->length; i++) {
+            v_printf(2, "\"%s\"\n", to_download->objects[i].name);
         }
         if (existing_only)
             v_printf(2, "Note: Non-existent files will be skipped.\n");
     }
 
-    if (to_download.length) {
+    if (to_download->length) {
         create_dirs(outputPath, true);
         struct download_args download_args = {
-            .to_download = &to_download,
+            .to_download = to_download,
             .output_path = outputPath,
             .verify_only = verify_only,
             .existing_only = existing_only,
-            .skip_existing = skip_existing
+            .skip_existing = skip_existing,
+            .decompress_threads = decompress_threads,
+            .write_threads = write_threads,
+            .io_uring = io_uring,
+            .sparse = sparse,
+            .direct_io = direct_io,
+            .mmap_output = mmap_output
         };
-        download_files(&download_args);
+        if (old_manifest_path && !verify_only) {
+            Manifest* old_manifest = open_manifest(old_manifest_path, index_cache_path);
+            if (!old_manifest) {
+                exit(EXIT_FAILURE);
+            }
+            // every file of the old install is a potential copy source, not just the ones matching the filters
+            load_files(old_manifest, NULL, NULL);
+            patch_files(&download_args, &old_manifest->files);
+            free_manifest(old_manifest);
+        } else {
+            download_files(&download_args);
+        }
     }
 
     #ifdef _WIN32
         WSACleanup();
     #endif
-    free(to_download.objects);
     free_manifest(parsed_manifest);
 }
@@ -0,0 +1,12 @@
+#ifndef MALLOC_STATS_H
+#define MALLOC_STATS_H
+
+#include <inttypes.h>
+
+// Built with MALLOC_STATS=1, malloc, calloc and realloc are wrapped by the linker (--wrap) to count how often they're
+// called, so that allocations in steady state show up in the -v output.
+#ifdef MALLOC_STATS
+uint64_t allocation_count(void);
+#endif
+
+#endif
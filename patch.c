@@ -0,0 +1,325 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "defs.h"
+#include "download.h"
+#include "general_utils.h"
+#include "hash_index.h"
+#include "list.h"
+#include "patch.h"
+#include "rman.h"
+
+
+// where a chunk can be found in the old install
+struct chunk_source {
+    uint32_t file_index;
+    uint32_t chunk_index;
+};
+
+struct patch_state {
+    const char* output_path;
+    const FileList* old_files;
+    bool* old_file_present; // whether the old file is on disk with its expected size
+    HashIndex path_index; // hash of the path -> index into old_files
+    HashIndex chunk_index; // chunk_id -> index into chunk_sources, only for chunks of present old files
+    LIST(struct chunk_source) chunk_sources;
+    FILE* source_file; // the old file the last chunk was copied from
+    uint32_t source_file_index;
+    uint64_t copied_bytes;
+};
+
+enum patch_mode {
+    PATCH_UNCHANGED,
+    PATCH_SKIPPED, // neither the file nor an old version of it exist, and only existing files should be updated
+    PATCH_IN_PLACE, // only missing chunks get written to the existing file
+    PATCH_DIRECT, // the file is built at its final path, no old file lives there
+    PATCH_REBUILD // the file is built next to its final path, since the old file there may still be a copy source
+};
+
+struct patched_file {
+    File file; // chunks only holds the chunks that need to be downloaded
+    char* final_path; // set for PATCH_REBUILD
+};
+
+
+static uint64_t hash_path(const char* path)
+{
+    // 64 bit FNV-1a
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (; *path; path++) {
+        hash = (hash ^ (uint8_t) *path) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+static char* output_path_of(const char* output_path, const char* name, const char* suffix)
+{
+    char* path = malloc(strlen(output_path) + 1 + strlen(name) + strlen(suffix) + 1);
+    sprintf(path, "%s/%s%s", output_path, name, suffix);
+    return path;
+}
+
+static bool file_has_size(const char* path, uint64_t size)
+{
+    struct stat file_info;
+    return stat(path, &file_info) == 0 && file_info.st_size == (off_t) size;
+}
+
+// returns the index of the old file called name, or HASH_INDEX_EMPTY if there's none
+static uint32_t find_old_file(const struct patch_state* state, const char* name)
+{
+    uint32_t index = hash_index_find(&state->path_index, hash_path(name));
+    if (index != HASH_INDEX_EMPTY && strcmp(state->old_files->objects[index].name, name) != 0)
+        return HASH_INDEX_EMPTY;
+    return index;
+}
+
+static void init_patch_state(struct patch_state* state, const char* output_path, const FileList* old_files)
+{
+    state->output_path = output_path;
+    state->old_files = old_files;
+    state->old_file_present = malloc(max(old_files->length, (uint32_t) 1) * sizeof(bool));
+    state->source_file = NULL;
+    state->copied_bytes = 0;
+    initialize_hash_index(&state->path_index, old_files->length);
+    initialize_hash_index(&state->chunk_index, old_files->length);
+    initialize_list(&state->chunk_sources);
+
+    // the old install is only stat'ed here; files are read once chunks actually get copied out of them
+    for (uint32_t i = 0; i < old_files->length; i++) {
+        const File* old_file = &old_files->objects[i];
+        hash_index_insert(&state->path_index, hash_path(old_file->name), i);
+        char* path = output_path_of(output_path, old_file->name, "");
+        state->old_file_present[i] = file_has_size(path, old_file->file_size);
+        free(path);
+        if (!state->old_file_present[i])
+            continue;
+        for (uint32_t j = 0; j < old_file->chunks.length; j++) {
+            if (hash_index_insert(&state->chunk_index, old_file->chunks.objects[j].chunk_id, state->chunk_sources.length))
+                add_object(&state->chunk_sources, (&(struct chunk_source) {i, j}));
+        }
+    }
+}
+
+static void free_patch_state(struct patch_state* state)
+{
+    if (state->source_file)
+        fclose(state->source_file);
+    free(state->chunk_sources.objects);
+    free_hash_index(&state->chunk_index);
+    free_hash_index(&state->path_index);
+    free(state->old_file_present);
+}
+
+// Reads the data of chunk from offset in file into chunk_data and checks it against the chunk's hash.
+static bool read_valid_chunk(FILE* file, uint64_t offset, const Chunk* chunk, BinaryData* chunk_data)
+{
+    return fseeko(file, offset, SEEK_SET) == 0
+        && fread(chunk_data->data, 1, chunk_data->length, file) == chunk_data->length
+        && chunk_valid(chunk_data, chunk->chunk_id, chunk->hashType);
+}
+
+// Copies chunk from the old install to its offset in output_file. Returns false if the chunk couldn't be read
+// or its data didn't match, in which case the chunk has to be downloaded instead.
+static bool copy_chunk(struct patch_state* state, const Chunk* chunk, FILE* output_file)
+{
+    uint32_t source_index = hash_index_find(&state->chunk_index, chunk->chunk_id);
+    if (source_index == HASH_INDEX_EMPTY)
+        return false;
+    struct chunk_source source = state->chunk_sources.objects[source_index];
+    if (!state->source_file || state->source_file_index != source.file_index) {
+        if (state->source_file)
+            fclose(state->source_file);
+        char* path = output_path_of(state->output_path, state->old_files->objects[source.file_index].name, "");
+        state->source_file = fopen(path, "rb");
+        state->source_file_index = source.file_index;
+        free(path);
+        if (!state->source_file)
+            return false;
+    }
+
+    const Chunk* old_chunk = &state->old_files->objects[source.file_index].chunks.objects[source.chunk_index];
+    BinaryData chunk_data = {
+        .length = chunk->uncompressed_size,
+        .data = malloc(chunk->uncompressed_size)
+    };
+    bool copied = read_valid_chunk(state->source_file, old_chunk->file_offset, chunk, &chunk_data);
+    if (copied) {
+        assert(fseeko(output_file, chunk->file_offset, SEEK_SET) == 0);
+        assert(fwrite(chunk_data.data, 1, chunk_data.length, output_file) == chunk_data.length);
+        state->copied_bytes += chunk_data.length;
+    }
+    free(chunk_data.data);
+
+    return copied;
+}
+
+// Checks whether chunk is still intact at its offset in the existing file, which may have been damaged or modified
+// since the old install was made.
+static bool chunk_in_place(const Chunk* chunk, FILE* existing_file)
+{
+    if (!existing_file)
+        return false;
+    BinaryData chunk_data = {
+        .length = chunk->uncompressed_size,
+        .data = malloc(chunk->uncompressed_size)
+    };
+    bool intact = read_valid_chunk(existing_file, chunk->file_offset, chunk, &chunk_data);
+    free(chunk_data.data);
+    return intact;
+}
+
+static bool same_chunks(const ChunkList* chunks, const ChunkList* other_chunks)
+{
+    if (chunks->length != other_chunks->length)
+        return false;
+    for (uint32_t i = 0; i < chunks->length; i++) {
+        if (chunks->objects[i].chunk_id != other_chunks->objects[i].chunk_id)
+            return false;
+    }
+    return true;
+}
+
+// Decides how to bring file up to date and prepares it on disk accordingly: copies all chunks available in the
+// old install and fills patched_file->file.chunks with the ones that still need to be downloaded.
+static enum patch_mode prepare_file(struct patch_state* state, const File* file, bool existing_only, struct patched_file* patched_file)
+{
+    uint32_t old_index = find_old_file(state, file->name);
+    bool old_present = old_index != HASH_INDEX_EMPTY && state->old_file_present[old_index];
+    const File* old_file = old_present ? &state->old_files->objects[old_index] : NULL;
+    if (old_file && old_file->file_size == file->file_size && same_chunks(&file->chunks, &old_file->chunks))
+        return PATCH_UNCHANGED;
+
+    char* path = output_path_of(state->output_path, file->name, "");
+    if (!old_file && existing_only && access(path, F_OK) != 0) {
+        free(path);
+        return PATCH_SKIPPED;
+    }
+
+    // chunks that stayed at their offset in the old file at the same path don't need to be written at all;
+    // both chunk lists are ordered by file_offset
+    bool* in_place = calloc(max(file->chunks.length, (uint32_t) 1), sizeof(bool));
+    bool needs_copies = false;
+    uint32_t old_chunk = 0;
+    for (uint32_t i = 0; i < file->chunks.length; i++) {
+        const Chunk* chunk = &file->chunks.objects[i];
+        if (old_file) {
+            while (old_chunk < old_file->chunks.length && old_file->chunks.objects[old_chunk].file_offset < chunk->file_offset)
+                old_chunk++;
+            if (old_chunk < old_file->chunks.length && old_file->chunks.objects[old_chunk].file_offset == chunk->file_offset
+             && old_file->chunks.objects[old_chunk].chunk_id == chunk->chunk_id) {
+                in_place[i] = true;
+                continue;
+            }
+        }
+        if (hash_index_find(&state->chunk_index, chunk->chunk_id) != HASH_INDEX_EMPTY)
+            needs_copies = true;
+    }
+
+    enum patch_mode mode = old_file ? needs_copies ? PATCH_REBUILD : PATCH_IN_PLACE : PATCH_DIRECT;
+    patched_file->file = *file;
+    patched_file->final_path = NULL;
+    if (mode == PATCH_REBUILD) {
+        patched_file->final_path = path;
+        path = output_path_of(state->output_path, file->name, ".part");
+        patched_file->file.name = malloc(strlen(file->name) + sizeof(".part"));
+        sprintf(patched_file->file.name, "%s.part", file->name);
+    }
+    initialize_list_size(&patched_file->file.chunks, max(file->chunks.length, (uint32_t) 1));
+
+    FILE* output_file = NULL;
+    if (mode == PATCH_IN_PLACE) {
+        // the file is only read here, to check its chunks; the download writes the missing ones
+        output_file = fopen(path, "rb");
+    } else {
+        create_dirs(path, false);
+        output_file = fopen(path, "wb");
+        if (!output_file) {
+            eprintf("Error: Failed to open \"%s\"\n", path);
+            exit(EXIT_FAILURE);
+        }
+        assert(ftruncate(fileno(output_file), file->file_size) == 0);
+    }
+    for (uint32_t i = 0; i < file->chunks.length; i++) {
+        const Chunk* chunk = &file->chunks.objects[i];
+        // a rebuilt file copies its unchanged chunks out of the old file at the same path; that one is only
+        // replaced once all files were prepared, so it stays available as a copy source until then
+        if (mode == PATCH_IN_PLACE ? in_place[i] && chunk_in_place(chunk, output_file) : copy_chunk(state, chunk, output_file))
+            continue;
+        add_object(&patched_file->file.chunks, chunk);
+    }
+    if (output_file)
+        fclose(output_file);
+    free(in_place);
+    free(path);
+
+    return mode;
+}
+
+void patch_files(struct download_args* args, const FileList* old_files)
+{
+    struct patch_state state;
+    init_patch_state(&state, args->output_path, old_files);
+
+    FileList* to_download = args->to_download;
+    struct patched_file* patched_files = malloc(max(to_download->length, (uint32_t) 1) * sizeof(struct patched_file));
+    uint32_t patched_count = 0;
+    uint32_t mode_counts[PATCH_REBUILD + 1] = {0};
+    uint64_t download_bytes = 0;
+    for (uint32_t i = 0; i < to_download->length; i++) {
+        enum patch_mode mode = prepare_file(&state, &to_download->objects[i], args->existing_only, &patched_files[patched_count]);
+        mode_counts[mode]++;
+        if (mode == PATCH_UNCHANGED || mode == PATCH_SKIPPED) {
+            v_printf(2, "%s file %s\n", mode == PATCH_UNCHANGED ? "Unchanged" : "Skipping", to_download->objects[i].name);
+            continue;
+        }
+        for (uint32_t j = 0; j < patched_files[patched_count].file.chunks.length; j++) {
+            download_bytes += patched_files[patched_count].file.chunks.objects[j].uncompressed_size;
+        }
+        patched_count++;
+    }
+    if (state.source_file) {
+        fclose(state.source_file);
+        state.source_file = NULL;
+    }
+    printf("Patch: %u files unchanged, %u patched in place, %u rebuilt, %u new; %"PRIu64" bytes copied from the old install, %"PRIu64" bytes to download.\n",
+        mode_counts[PATCH_UNCHANGED], mode_counts[PATCH_IN_PLACE], mode_counts[PATCH_REBUILD], mode_counts[PATCH_DIRECT], state.copied_bytes, download_bytes);
+
+    FileList patch_list = {.length = patched_count, .allocated_length = patched_count};
+    patch_list.objects = malloc(max(patched_count, (uint32_t) 1) * sizeof(File));
+    for (uint32_t i = 0; i < patched_count; i++) {
+        patch_list.objects[i] = patched_files[i].file;
+    }
+    struct download_args patch_args = *args;
+    patch_args.to_download = &patch_list;
+    patch_args.patch = true;
+    if (patched_count)
+        download_files(&patch_args);
+
+    for (uint32_t i = 0; i < patched_count; i++) {
+        if (patched_files[i].final_path) {
+            char* part_path = output_path_of(args->output_path, patched_files[i].file.name, "");
+#ifdef _WIN32
+            remove(patched_files[i].final_path);
+#endif
+            if (rename(part_path, patched_files[i].final_path) != 0) {
+                eprintf("Error: Failed to move \"%s\" to \"%s\".\n", part_path, patched_files[i].final_path);
+                exit(EXIT_FAILURE);
+            }
+            free(part_path);
+            free(patched_files[i].final_path);
+            free(patched_files[i].file.name);
+        }
+        free(patched_files[i].file.chunks.objects);
+    }
+    free(patch_list.objects);
+    free(patched_files);
+    free_patch_state(&state);
+}
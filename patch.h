@@ -0,0 +1,13 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include "download.h"
+#include "rman.h"
+
+// Updates an install of old_files (the files of the previously installed manifest) to args->to_download.
+// Files whose chunk list didn't change aren't touched at all. Chunks that are still present somewhere in the old
+// install are copied from there, only new chunks get downloaded. Files whose unchanged chunks all kept their offset
+// are patched in place (after checking those chunks' hashes), everything else is rebuilt next to the final path and moved there once all downloads are done.
+void patch_files(struct download_args* args, const FileList* old_files);
+
+#endif
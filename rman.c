@@ -1,4 +1,11 @@
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#ifndef _WIN32
+    #include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -9,7 +16,11 @@
 #include "zstd/zstd.h"
 #include "BLAKE3/c/blake3.h"
 
+#include "arena.h"
 #include "defs.h"
+#include "general_utils.h"
+#include "hash_index.h"
+#include "index_cache.h"
 #include "list.h"
 #include "rman.h"
 
@@ -98,153 +109,403 @@ bool chunk_valid(BinaryData* chunk, uint64_t chunk_id, HashType hashType)
 
 BundleList* group_by_bundles(ChunkList* chunks)
 {
+    // sort by bundle_offset first, then (stable) by bundle_id
+    SortPair* keys = malloc(max(chunks->length, (uint32_t) 1) * sizeof(SortPair));
+    for (uint32_t i = 0; i < chunks->length; i++) {
+        keys[i] = (SortPair) {.key = chunks->objects[i].bundle_offset, .index = i};
+    }
+    radix_sort_pairs(keys, chunks->length);
+    for (uint32_t i = 0; i < chunks->length; i++) {
+        keys[i].key = chunks->objects[keys[i].index].bundle_id;
+    }
+    radix_sort_pairs(keys, chunks->length);
+
+    // all bundles' chunk lists are slices of one array, which is owned by the first bundle (see free_bundle_list)
+    Chunk* sorted_chunks = malloc(max(chunks->length, (uint32_t) 1) * sizeof(Chunk));
+    for (uint32_t i = 0; i < chunks->length; i++) {
+        sorted_chunks[i] = chunks->objects[keys[i].index];
+    }
+    free(keys);
+
     BundleList* unique_bundles = malloc(sizeof(BundleList));
     initialize_list(unique_bundles);
-    for (uint32_t i = 0; i < chunks->length; i++) {
-        Bundle* to_find = NULL;
-        find_object_s(unique_bundles, to_find, bundle_id, chunks->objects[i].bundle_id);
-        if (!to_find) {
-            Bundle to_add = {.bundle_id = chunks->objects[i].bundle_id};
-            initialize_list(&to_add.chunks);
-            add_object_s(&to_add.chunks, &chunks->objects[i], bundle_offset);
-            add_object_s(unique_bundles, &to_add, bundle_id);
-        } else {
-            add_object_s(&to_find->chunks, &chunks->objects[i], bundle_offset);
-        }
+    for (uint32_t start = 0, end; start < chunks->length; start = end) {
+        for (end = start + 1; end < chunks->length && sorted_chunks[end].bundle_id == sorted_chunks[start].bundle_id; end++);
+        Bundle new_bundle = {
+            .bundle_id = sorted_chunks[start].bundle_id,
+            .chunks = {.length = end - start, .allocated_length = end - start, .objects = &sorted_chunks[start]}
+        };
+        add_object(unique_bundles, &new_bundle);
     }
+    if (unique_bundles->length == 0)
+        free(sorted_chunks);
 
     return unique_bundles;
 }
 
-void free_manifest(Manifest* manifest)
+void free_bundle_list(BundleList* bundles)
 {
-    free(manifest->chunks.objects);
+    if (bundles->length)
+        free(bundles->objects[0].chunks.objects);
+    free(bundles->objects);
+    free(bundles);
+}
 
-    for (uint32_t i = 0; i < manifest->bundles.length; i++) {
-        free(manifest->bundles.objects[i].chunks.objects);
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Allocates the buffer the manifest body gets decompressed into. Bodies of at least one huge page get their own
+// anonymous mapping, preferably from the huge page pool, otherwise with a hint to back it with transparent huge pages.
+// mapping_size is set to the size of the mapping, or 0 if the buffer was malloc'ed.
+static uint8_t* allocate_body(size_t size, size_t* mapping_size)
+{
+    *mapping_size = 0;
+#ifndef _WIN32
+    if (size >= HUGE_PAGE_SIZE) {
+        size_t rounded_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+        void* body = mmap(NULL, rounded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (body == MAP_FAILED) {
+            body = mmap(NULL, rounded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (body != MAP_FAILED)
+                madvise(body, rounded_size, MADV_HUGEPAGE);
+        }
+        if (body != MAP_FAILED) {
+            *mapping_size = rounded_size;
+            return body;
+        }
     }
-    free(manifest->bundles.objects);
+#endif
+    return malloc(size);
+}
 
-    for (uint32_t i = 0; i < manifest->files.length; i++) {
-        free(manifest->files.objects[i].link);
-        free(manifest->files.objects[i].name);
-        free(manifest->files.objects[i].languages.objects);
-        free(manifest->files.objects[i].chunks.objects);
+static void free_body(uint8_t* body, size_t mapping_size)
+{
+#ifndef _WIN32
+    if (mapping_size) {
+        munmap(body, mapping_size);
+        return;
     }
-    free(manifest->files.objects);
+#endif
+    free(body);
+}
 
-    for (uint32_t i = 0; i < manifest->languages.length; i++) {
-        free(manifest->languages.objects[i].name);
+void free_manifest(Manifest* manifest)
+{
+    if (manifest->index_cache) {
+        // the chunks and their index point into the cache file
+        close_index_cache(manifest->index_cache);
+    } else {
+        free(manifest->chunks.objects);
+        free_hash_index(&manifest->chunk_index);
     }
+
+    free(manifest->bundles.objects);
+    free(manifest->files.objects);
+
     free(manifest->languages.objects);
 
     free(manifest->parameters.objects);
 
+    free_hash_index(&manifest->directory_index);
+
+    // file names, languages and chunk lists, bundle chunk lists and directory paths
+    free_arena(&manifest->arena);
+
+    free_body(manifest->body, manifest->body_mapping_size);
+
     free(manifest);
 }
 
-char* duplicate_string(String* string)
+void init_manifest_view(ManifestView* view, uint8_t* body)
 {
-    char* new_string = malloc(string->length + 1);
-    memcpy(new_string, string->objects, string->length + 1);
+    FlatBufferObject rootObject = FlatBufferObject_of(body);
 
-    return new_string;
+    view->bundles = object_of(get_field(&rootObject, 0));
+    view->languages = object_of(get_field(&rootObject, 1));
+    view->file_entries = object_of(get_field(&rootObject, 2));
+    view->directories = object_of(get_field(&rootObject, 3));
+    view->parameters = object_of(get_field(&rootObject, 5));
 }
 
-int parse_body(Manifest* manifest, uint8_t* body)
+FileEntry get_file_entry(const ManifestView* view, uint32_t index)
 {
-    FlatBufferObject rootObject = FlatBufferObject_of(body);
+    FlatBufferObject fileEntryObject = FlatBufferObject_of(&view->file_entries->objects[index]);
+
+    return (FileEntry) {
+        .file_entry_id = to_(uint64_t, get_field(&fileEntryObject, 0)),
+        .directory_id = fileEntryObject.vtable->offsets[1] ? to_(uint64_t, get_field(&fileEntryObject, 1)) : 0,
+        .file_size = to_(uint64_t, get_field(&fileEntryObject, 2)),
+        .language_mask = fileEntryObject.vtable->offsets[4] ? to_(uint64_t, get_field(&fileEntryObject, 4)) : 0,
+        .name = object_of(get_field(&fileEntryObject, 3)),
+        .link = object_of(get_field(&fileEntryObject, 9)),
+        .chunk_ids = object_of(get_field(&fileEntryObject, 7)),
+        .param_index = fileEntryObject.vtable->offsets[11] ? to_(uint8_t, get_field(&fileEntryObject, 11)) : 0,
+    };
+}
 
-    // bundles (and their chunks)
-    OffsetVector* bundle_offsets = object_of(get_field(&rootObject, 0));
-    initialize_list_size(&manifest->bundles, bundle_offsets->length);
-    uint32_t total_chunks = 0;
-    for (uint32_t i = 0; i < bundle_offsets->length; i++) {
-        FlatBufferObject bundleObject = FlatBufferObject_of(&bundle_offsets->objects[i]);
+Directory get_directory(const ManifestView* view, uint32_t index)
+{
+    FlatBufferObject directoryObject = FlatBufferObject_of(&view->directories->objects[index]);
 
-        Bundle new_bundle = {
-            .bundle_id = to_(uint64_t, get_field(&bundleObject, 0))
+    return (Directory) {
+        .directory_id = to_(uint64_t, get_field(&directoryObject, 0)),
+        .parent_id = directoryObject.vtable->offsets[1] ? to_(uint64_t, get_field(&directoryObject, 1)) : 0,
+        .name = object_of(get_field(&directoryObject, 2))
+    };
+}
+
+static const char* directory_path_of(Manifest* manifest, uint32_t index, uint32_t depth)
+{
+    if (manifest->directory_paths[index])
+        return manifest->directory_paths[index];
+    // a directory can't be nested deeper than there are directories, unless the parent ids form a cycle
+    assert(depth < manifest->view.directories->length);
+
+    Directory directory = get_directory(&manifest->view, index);
+    const char* parent_path = "";
+    if (directory.parent_id) {
+        uint32_t parent_index = hash_index_find(&manifest->directory_index, directory.parent_id);
+        assert(parent_index != HASH_INDEX_EMPTY);
+        parent_path = directory_path_of(manifest, parent_index, depth + 1);
+    }
+    size_t parent_length = strlen(parent_path);
+    char* path = arena_alloc(&manifest->arena, parent_length + 1 + directory.name->length + 1);
+    if (parent_length) {
+        memcpy(path, parent_path, parent_length);
+        path[parent_length++] = '/';
+    }
+    memcpy(path + parent_length, directory.name->objects, directory.name->length + 1);
+    manifest->directory_paths[index] = path;
+
+    return path;
+}
+
+const char* get_directory_path(Manifest* manifest, uint64_t directory_id)
+{
+    if (!directory_id)
+        return "";
+    uint32_t index = hash_index_find(&manifest->directory_index, directory_id);
+    assert(index != HASH_INDEX_EMPTY);
+
+    return directory_path_of(manifest, index, 0);
+}
+
+// path needs room for directory_length + 1 + file_entry->name->length + 1 bytes
+static void build_file_path(const FileEntry* file_entry, const char* directory_path, size_t directory_length, char* path)
+{
+    if (directory_length) {
+        memcpy(path, directory_path, directory_length);
+        path[directory_length++] = '/';
+    }
+    memcpy(path + directory_length, file_entry->name->objects, file_entry->name->length + 1);
+}
+
+char* get_file_path(Manifest* manifest, const FileEntry* file_entry)
+{
+    const char* directory_path = get_directory_path(manifest, file_entry->directory_id);
+    size_t directory_length = strlen(directory_path);
+    char* path = arena_alloc(&manifest->arena, directory_length + 1 + file_entry->name->length + 1);
+    build_file_path(file_entry, directory_path, directory_length, path);
+
+    return path;
+}
+
+Chunk* find_chunk(const Manifest* manifest, uint64_t chunk_id)
+{
+    uint32_t index = hash_index_find(&manifest->chunk_index, chunk_id);
+    return index == HASH_INDEX_EMPTY ? NULL : &manifest->chunks.objects[index];
+}
+
+// fills chunks->objects, which has to have room for all chunks of file_entry
+static void fill_chunks(const Manifest* manifest, const FileEntry* file_entry, ChunkList* chunks)
+{
+    uint64_t file_offset = 0;
+    for (uint32_t i = 0; i < file_entry->chunk_ids->length; i++) {
+        Chunk* chunk = find_chunk(manifest, file_entry->chunk_ids->objects[i]);
+        assert(chunk);
+        // the entry in manifest->chunks is shared by every file containing this chunk, so only modify the copy
+        chunks->objects[i] = *chunk;
+        chunks->objects[i].file_offset = file_offset;
+        chunks->objects[i].hashType = manifest->parameters.objects[file_entry->param_index].hashType;
+        file_offset += chunk->uncompressed_size;
+    }
+    chunks->length = file_entry->chunk_ids->length;
+}
+
+void resolve_chunks(Manifest* manifest, const FileEntry* file_entry, ChunkList* chunks)
+{
+    initialize_list_arena(chunks, file_entry->chunk_ids->length, &manifest->arena);
+    fill_chunks(manifest, file_entry, chunks);
+}
+
+struct resolve_files_args {
+    Manifest* manifest;
+    File* files;
+    uint32_t* entry_indices;
+};
+
+static void resolve_files(void* _args, uint32_t start, uint32_t end)
+{
+    struct resolve_files_args* args = _args;
+    for (uint32_t i = start; i < end; i++) {
+        FileEntry file_entry = get_file_entry(&args->manifest->view, args->entry_indices[i]);
+        fill_chunks(args->manifest, &file_entry, &args->files[i].chunks);
+    }
+}
+
+void load_files(Manifest* manifest, FileFilter filter, void* filter_data)
+{
+    load_files_in(manifest, filter, filter_data, &manifest->arena);
+}
+
+void load_files_in(Manifest* manifest, FileFilter filter, void* filter_data, Arena* arena)
+{
+    if (manifest->index_cache) {
+        load_cached_files(manifest, filter, filter_data, arena);
+        return;
+    }
+
+    // candidates are built in scratch space and only copied to the arena if the filter accepts them
+    size_t path_buffer_size = 256;
+    char* path_buffer = malloc(path_buffer_size);
+    Language languages[64];
+    uint32_t first_file = manifest->files.length;
+    uint32_list entry_indices;
+    initialize_list(&entry_indices);
+    uint64_t total_chunks = 0;
+
+    for (uint32_t i = 0; i < manifest->view.file_entries->length; i++) {
+        FileEntry file_entry = get_file_entry(&manifest->view, i);
+        const char* directory_path = get_directory_path(manifest, file_entry.directory_id);
+        size_t directory_length = strlen(directory_path);
+        size_t path_length = directory_length + 1 + file_entry.name->length;
+        if (path_length + 1 > path_buffer_size) {
+            path_buffer_size = path_length + 1;
+            path_buffer = realloc(path_buffer, path_buffer_size);
+        }
+        build_file_path(&file_entry, directory_path, directory_length, path_buffer);
+        File new_file = {
+            .name = path_buffer,
+            .link = file_entry.link->objects,
+            .languages = {.allocated_length = 64, .objects = languages},
+            .file_size = file_entry.file_size
         };
+        for (int j = 0; j < 64; j++) {
+            if (file_entry.language_mask & (1ull << j)) {
+                Language* language = NULL;
+                find_object_s(&manifest->languages, language, language_id, j + 1);
+                add_object(&new_file.languages, language);
+            }
+        }
+        if (filter && !filter(&new_file, filter_data))
+            continue;
+
+        new_file.name = arena_alloc(arena, path_length + 1);
+        memcpy(new_file.name, path_buffer, path_length + 1);
+        new_file.languages.objects = arena_alloc(arena, new_file.languages.length * sizeof(Language));
+        memcpy(new_file.languages.objects, languages, new_file.languages.length * sizeof(Language));
+        new_file.languages.allocated_length = new_file.languages.length;
+        new_file.chunks.allocated_length = file_entry.chunk_ids->length;
+        total_chunks += file_entry.chunk_ids->length;
+        add_object(&manifest->files, &new_file);
+        add_object(&entry_indices, &i);
+    }
+    free(path_buffer);
 
+    // the chunk lists of all new files are slices of one allocation, which the workers fill independently
+    Chunk* chunks = arena_alloc(arena, total_chunks * sizeof(Chunk));
+    for (uint32_t i = first_file; i < manifest->files.length; i++) {
+        manifest->files.objects[i].chunks.objects = chunks;
+        chunks += manifest->files.objects[i].chunks.allocated_length;
+    }
+    struct resolve_files_args resolve_files_args = {
+        .manifest = manifest,
+        .files = &manifest->files.objects[first_file],
+        .entry_indices = entry_indices.objects
+    };
+    parallel_for(entry_indices.length, 256, amount_of_threads, resolve_files, &resolve_files_args);
+    free(entry_indices.objects);
+
+    // the stats of whichever arena the files went to, which may be scratch space rather than the manifest's
+    v_printf(2, "%s memory: %"PRIu64" allocations served from %"PRIu64" heap blocks (%"PRIu64" KiB)\n", arena == &manifest->arena ? "Manifest" : "File list",
+        arena->allocations, arena->block_allocations, arena->allocated_bytes / 1024);
+}
+
+static void parse_bundles(void* _manifest, uint32_t start, uint32_t end)
+{
+    Manifest* manifest = _manifest;
+    for (uint32_t i = start; i < end; i++) {
+        FlatBufferObject bundleObject = FlatBufferObject_of(&manifest->view.bundles->objects[i]);
         OffsetVector* chunk_offsets = object_of(get_field(&bundleObject, 1));
-        initialize_list_size(&new_bundle.chunks, chunk_offsets->length);
-        for (uint32_t i = 0; i < chunk_offsets->length; i++) {
-            FlatBufferObject chunkObject = FlatBufferObject_of(&chunk_offsets->objects[i]);
+        Bundle* bundle = &manifest->bundles.objects[i];
+        uint32_t bundle_offset = 0;
+        for (uint32_t j = 0; j < chunk_offsets->length; j++) {
+            FlatBufferObject chunkObject = FlatBufferObject_of(&chunk_offsets->objects[j]);
 
-            Chunk new_chunk = {
+            bundle->chunks.objects[j] = (Chunk) {
                 .compressed_size = to_(uint32_t, get_field(&chunkObject, 1)),
                 .uncompressed_size = to_(uint32_t, get_field(&chunkObject, 2)),
                 .chunk_id = to_(uint64_t, get_field(&chunkObject, 0)),
-                .bundle_offset = i == 0 ? 0 : new_bundle.chunks.objects[i - 1].bundle_offset + new_bundle.chunks.objects[i - 1].compressed_size,
-                .bundle_id = new_bundle.bundle_id
+                .bundle_offset = bundle_offset,
+                .bundle_id = bundle->bundle_id
             };
-            add_object(&new_bundle.chunks, &new_chunk);
+            bundle_offset += bundle->chunks.objects[j].compressed_size;
         }
+        bundle->chunks.length = chunk_offsets->length;
+    }
+}
+
+int parse_body(Manifest* manifest, uint8_t* body)
+{
+    init_manifest_view(&manifest->view, body);
+    initialize_arena(&manifest->arena, 1024 * 1024);
+
+    // bundles (and their chunks); the chunk lists of all bundles are slices of one allocation,
+    // which is sized up front so the bundles can be parsed in parallel
+    OffsetVector* bundle_offsets = manifest->view.bundles;
+    initialize_list_size(&manifest->bundles, max(bundle_offsets->length, (uint32_t) 1));
+    uint32_t total_chunks = 0;
+    for (uint32_t i = 0; i < bundle_offsets->length; i++) {
+        FlatBufferObject bundleObject = FlatBufferObject_of(&bundle_offsets->objects[i]);
+        OffsetVector* chunk_offsets = object_of(get_field(&bundleObject, 1));
+
+        Bundle new_bundle = {
+            .bundle_id = to_(uint64_t, get_field(&bundleObject, 0)),
+            .chunks = {.allocated_length = chunk_offsets->length}
+        };
         add_object(&manifest->bundles, &new_bundle);
         total_chunks += chunk_offsets->length;
     }
-    initialize_list_size(&manifest->chunks, total_chunks);
+    Chunk* bundle_chunks = arena_alloc(&manifest->arena, (uint64_t) total_chunks * sizeof(Chunk));
     for (uint32_t i = 0; i < manifest->bundles.length; i++) {
-        add_objects(&manifest->chunks, manifest->bundles.objects[i].chunks.objects, manifest->bundles.objects[i].chunks.length);
+        manifest->bundles.objects[i].chunks.objects = bundle_chunks;
+        bundle_chunks += manifest->bundles.objects[i].chunks.allocated_length;
+    }
+    parallel_for(manifest->bundles.length, 64, amount_of_threads, parse_bundles, manifest);
+
+    initialize_list_size(&manifest->chunks, max(total_chunks, (uint32_t) 1));
+    if (manifest->bundles.length)
+        add_objects(&manifest->chunks, manifest->bundles.objects[0].chunks.objects, total_chunks);
+    radix_sort_list(&manifest->chunks, chunk_id);
+    initialize_hash_index(&manifest->chunk_index, manifest->chunks.length);
+    for (uint32_t i = 0; i < manifest->chunks.length; i++) {
+        hash_index_insert(&manifest->chunk_index, manifest->chunks.objects[i].chunk_id, i);
     }
-    sort_list(&manifest->chunks, chunk_id);
 
     // languages
-    OffsetVector* language_offsets = object_of(get_field(&rootObject, 1));
+    OffsetVector* language_offsets = manifest->view.languages;
     initialize_list_size(&manifest->languages, language_offsets->length);
     for (uint32_t i = 0; i < language_offsets->length; i++) {
         FlatBufferObject languageObject = FlatBufferObject_of(&language_offsets->objects[i]);
 
         Language new_language = {
             .language_id = to_(uint8_t, get_field(&languageObject, 0)),
-            .name = duplicate_string(object_of(get_field(&languageObject, 1)))
+            .name = ((String*) object_of(get_field(&languageObject, 1)))->objects
         };
         add_object_s(&manifest->languages, &new_language, language_id);
     }
 
-    // file entries
-    FileEntryList file_entries;
-    OffsetVector* file_entry_offsets = object_of(get_field(&rootObject, 2));
-    initialize_list_size(&file_entries, file_entry_offsets->length);
-    for (uint32_t i = 0; i < file_entry_offsets->length; i++) {
-        FlatBufferObject fileEntryObject = FlatBufferObject_of(&file_entry_offsets->objects[i]);
-
-        FileEntry new_file_entry = {
-            .file_entry_id = to_(uint64_t, get_field(&fileEntryObject, 0)),
-            .directory_id = fileEntryObject.vtable->offsets[1] ? to_(uint64_t, get_field(&fileEntryObject, 1)) : 0,
-            .file_size = to_(uint64_t, get_field(&fileEntryObject, 2)),
-            .name = object_of(get_field(&fileEntryObject, 3)),
-            .link = object_of(get_field(&fileEntryObject, 9)),
-            .chunk_ids = object_of(get_field(&fileEntryObject, 7)),
-            .param_index = fileEntryObject.vtable->offsets[11] ? to_(uint8_t, get_field(&fileEntryObject, 11)) : 0,
-        };
-        uint64_t language_mask = fileEntryObject.vtable->offsets[4] ? to_(uint64_t, get_field(&fileEntryObject, 4)) : 0;
-        initialize_list(&new_file_entry.language_ids);
-        for (int i = 0; i < 64; i++) {
-            if (language_mask & (1ull << i)) {
-                add_object(&new_file_entry.language_ids, &(uint8_t) {i+1});
-            }
-        }
-        add_object(&file_entries, &new_file_entry);
-    }
-
-    // directories
-    DirectoryList directories;
-    OffsetVector* directory_offsets = object_of(get_field(&rootObject, 3));
-    initialize_list_size(&directories, directory_offsets->length);
-    for (uint32_t i = 0; i < directory_offsets->length; i++) {
-        FlatBufferObject directoryObject = FlatBufferObject_of(&directory_offsets->objects[i]);
-
-        Directory new_directory = {
-            .directory_id = to_(uint64_t, get_field(&directoryObject, 0)),
-            .parent_id = directoryObject.vtable->offsets[1] ? to_(uint64_t, get_field(&directoryObject, 1)) : 0,
-            .name = object_of(get_field(&directoryObject, 2))
-        };
-        add_object(&directories, &new_directory);
-    }
-
     // chunk compression parameters, mainly need the hash type
-    OffsetVector* parameter_offsets = object_of(get_field(&rootObject, 5));
+    OffsetVector* parameter_offsets = manifest->view.parameters;
     initialize_list_size(&manifest->parameters, parameter_offsets->length);
     for (uint32_t i = 0; i < parameter_offsets->length; i++) {
         FlatBufferObject parametersObject = FlatBufferObject_of(&parameter_offsets->objects[i]);
@@ -255,53 +516,16 @@ int parse_body(Manifest* manifest, uint8_t* body)
         add_object(&manifest->parameters, &parameters);
     }
 
-    // merge directories and file_entries together to a list of files
-    initialize_list_size(&manifest->files, file_entries.length);
-    for (uint32_t i = 0; i < file_entries.length; i++) {
-        File new_file = {
-            .file_size = file_entries.objects[i].file_size,
-            .link = duplicate_string(file_entries.objects[i].link)
-        };
-        initialize_list_size(&new_file.languages, file_entries.objects[i].language_ids.length);
-        for (uint32_t j = 0; j < file_entries.objects[i].language_ids.length; j++) {
-            Language* language = NULL;
-            find_object_s(&manifest->languages, language, language_id, file_entries.objects[i].language_ids.objects[j]);
-            add_object(&new_file.languages, language);
-        }
-        uint64_t directory_id = file_entries.objects[i].directory_id;
-        char temp_name[256];
-        strcpy(temp_name, file_entries.objects[i].name->objects);
-        while (directory_id) {
-            uint32_t j;
-            for (j = 0; j < directories.length; j++) {
-                if (directories.objects[j].directory_id == directory_id)
-                    break;
-            }
-            assert(j < directories.length);
-            directory_id = directories.objects[j].parent_id;
-            char backup_name[255];
-            strcpy(backup_name, temp_name);
-            assert(sprintf(temp_name, "%s/%s", directories.objects[j].name->objects, backup_name) < 256);
-        }
-        new_file.name = strdup(temp_name);
-        initialize_list_size(&new_file.chunks, file_entries.objects[i].chunk_ids->length);
-        uint64_t file_offset = 0;
-        for (uint32_t j = 0; j < file_entries.objects[i].chunk_ids->length; j++) {
-            Chunk* chunk = NULL;
-            find_object_s(&manifest->chunks, chunk, chunk_id, file_entries.objects[i].chunk_ids->objects[j]);
-            chunk->file_offset = file_offset;
-            chunk->hashType = manifest->parameters.objects[file_entries.objects[i].param_index].hashType;
-            add_object(&new_file.chunks, chunk);
-            file_offset += chunk->uncompressed_size;
-        }
-        add_object(&manifest->files, &new_file);
+    // directories; their paths are built once on first use and then shared by all files inside them
+    initialize_hash_index(&manifest->directory_index, manifest->view.directories->length);
+    for (uint32_t i = 0; i < manifest->view.directories->length; i++) {
+        hash_index_insert(&manifest->directory_index, get_directory(&manifest->view, i).directory_id, i);
     }
+    manifest->directory_paths = arena_alloc(&manifest->arena, manifest->view.directories->length * sizeof(char*));
+    memset(manifest->directory_paths, 0, manifest->view.directories->length * sizeof(char*));
 
-    for (uint32_t i = 0; i < file_entries.length; i++) {
-        free(file_entries.objects[i].language_ids.objects);
-    }
-    free(file_entries.objects);
-    free(directories.objects);
+    // files are only materialized on request (see load_files), so that filtered runs don't pay for all of them
+    initialize_list(&manifest->files);
 
     dprintf("amount of chunks in this manifest: %u\n", total_chunks);
 
@@ -322,36 +546,86 @@ Manifest* parse_manifest_data(uint8_t* data)
     }
 
     Manifest* manifest = malloc(sizeof(Manifest));
+    manifest->index_cache = NULL;
     uint32_t contentOffset = to_(uint32_t, data + 8);
     uint32_t compressedSize = to_(uint32_t, data + 12);
     manifest->manifest_id = to_(uint64_t, data + 16);
     uint32_t uncompressedSize = to_(uint32_t, data + 24);
 
-    uint8_t* uncompressed_body = malloc(uncompressedSize);
-    assert(ZSTD_decompress(uncompressed_body, uncompressedSize, data + contentOffset, compressedSize) == uncompressedSize);
+    manifest->body = allocate_body(uncompressedSize, &manifest->body_mapping_size);
+    size_t decompressed_size = ZSTD_decompress(manifest->body, uncompressedSize, data + contentOffset, compressedSize);
+    if (decompressed_size != uncompressedSize) {
+        eprintf("Error: Failed to decompress manifest body (%s).\n", ZSTD_isError(decompressed_size) ? ZSTD_getErrorName(decompressed_size) : "size mismatch");
+        free_body(manifest->body, manifest->body_mapping_size);
+        free(manifest);
+        return NULL;
+    }
 
-    parse_body(manifest, uncompressed_body);
-    free(uncompressed_body);
+    parse_body(manifest, manifest->body);
 
     return manifest;
 }
 
-Manifest* parse_manifest_f(char* filepath)
+bool read_manifest_id(const char* filepath, uint64_t* manifest_id)
 {
+    uint8_t header[28];
     FILE* manifest_file = fopen(filepath, "rb");
-    if (!manifest_file) {
+    if (!manifest_file)
+        return false;
+    bool is_manifest = fread(header, sizeof(header), 1, manifest_file) == 1 && strncmp((char*) header, "RMAN", 4) == 0;
+    fclose(manifest_file);
+    if (is_manifest)
+        *manifest_id = to_(uint64_t, header + 16);
+
+    return is_manifest;
+}
+
+Manifest* parse_manifest_f(char* filepath)
+{
+    int manifest_fd = open(filepath, O_RDONLY | O_BINARY);
+    if (manifest_fd == -1) {
         eprintf("Error: Couldn't open manifest file (%s).\n", filepath);
         return NULL;
     }
-    // figure out the length of the file, to allocate the exact amount of needed memory
-    fseek(manifest_file, 0, SEEK_END);
-    int file_size = ftell(manifest_file);
-    rewind(manifest_file);
+    struct stat file_info;
+    if (fstat(manifest_fd, &file_info) == -1 || file_info.st_size < 28) {
+        eprintf("Error: Manifest file \"%s\" is too small.\n", filepath);
+        close(manifest_fd);
+        return NULL;
+    }
+    size_t file_size = file_info.st_size;
+
+    // the raw file is only needed until its body is decompressed, so map it instead of copying it to the heap
+#ifndef _WIN32
+    uint8_t* raw_manifest = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, manifest_fd, 0);
+    close(manifest_fd);
+    if (raw_manifest == MAP_FAILED) {
+        eprintf("Error: Couldn't map manifest file (%s).\n", filepath);
+        return NULL;
+    }
+    madvise(raw_manifest, file_size, MADV_SEQUENTIAL);
+#else
     uint8_t* raw_manifest = malloc(file_size);
-    assert(fread(raw_manifest, 1, file_size, manifest_file) == (size_t) file_size);
-    fclose(manifest_file);
+    bool read_failed = read(manifest_fd, raw_manifest, file_size) != (ssize_t) file_size;
+    close(manifest_fd);
+    if (read_failed) {
+        eprintf("Error: Couldn't read manifest file (%s).\n", filepath);
+        free(raw_manifest);
+        return NULL;
+    }
+#endif
+
+    Manifest* parsed_manifest = NULL;
+    if ((uint64_t) to_(uint32_t, raw_manifest + 8) + to_(uint32_t, raw_manifest + 12) > file_size) {
+        eprintf("Error: Manifest file \"%s\" is truncated.\n", filepath);
+    } else {
+        parsed_manifest = parse_manifest_data(raw_manifest);
+    }
 
-    Manifest* parsed_manifest = parse_manifest_data(raw_manifest);
+#ifndef _WIN32
+    munmap(raw_manifest, file_size);
+#else
     free(raw_manifest);
+#endif
     return parsed_manifest;
 }
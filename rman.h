@@ -4,6 +4,8 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+#include "arena.h"
+#include "hash_index.h"
 #include "list.h"
 
 #define Vector(type) struct __attribute__((packed)) { \
@@ -65,20 +67,18 @@ typedef struct file_entry {
     uint64_t file_entry_id;
     uint64_t directory_id;
     uint64_t file_size;
-    uint8_list language_ids;
+    uint64_t language_mask;
     Vector(uint64_t)* chunk_ids;
     String* name;
     String* link;
     uint8_t param_index;
 } FileEntry;
-typedef LIST(FileEntry) FileEntryList;
 
 typedef struct directory {
     uint64_t directory_id;
     uint64_t parent_id;
     String* name;
 } Directory;
-typedef LIST(Directory) DirectoryList;
 
 typedef struct file {
     char* name;
@@ -95,17 +95,56 @@ typedef struct parameters {
 } Parameters;
 typedef LIST(Parameters) ParametersList;
 
+// read-only view of the tables in a manifest body; entries are read straight out of the flatbuffer when requested
+typedef struct manifest_view {
+    OffsetVector* bundles;
+    OffsetVector* languages;
+    OffsetVector* file_entries;
+    OffsetVector* directories;
+    OffsetVector* parameters;
+} ManifestView;
+
 typedef struct manifest {
     uint64_t manifest_id;
-    ChunkList chunks;
+    // the decompressed manifest body; strings of the parsed structures point into it, so it lives as long as the manifest
+    uint8_t* body;
+    size_t body_mapping_size;
+    ManifestView view; // zeroed for manifests opened from an index cache, which have no body
+    struct index_cache* index_cache; // set if the manifest was opened from an index cache, see index_cache.h
+    Arena arena; // owns everything allocated per bundle, file and directory
+    ChunkList chunks; // sorted by chunk_id
+    HashIndex chunk_index; // chunk_id -> index into chunks
+    HashIndex directory_index; // directory_id -> index into view.directories
+    char** directory_paths; // full path of each directory in view.directories, built on first use
     BundleList bundles;
     LanguageList languages;
-    FileList files;
+    FileList files; // only contains the files added by load_files
     ParametersList parameters;
 } Manifest;
 
+// decides whether load_files should keep a file; chunks of the file are not resolved yet when this is called
+typedef bool (*FileFilter)(const File* file, void* data);
+
 void free_manifest(Manifest* manifest);
 
+// reads the manifest id from the header of an RMAN file without parsing the file; returns false if it isn't one
+bool read_manifest_id(const char* filepath, uint64_t* manifest_id);
+
+void init_manifest_view(ManifestView* view, uint8_t* body);
+FileEntry get_file_entry(const ManifestView* view, uint32_t index);
+Directory get_directory(const ManifestView* view, uint32_t index);
+const char* get_directory_path(Manifest* manifest, uint64_t directory_id);
+char* get_file_path(Manifest* manifest, const FileEntry* file_entry);
+Chunk* find_chunk(const Manifest* manifest, uint64_t chunk_id);
+void resolve_chunks(Manifest* manifest, const FileEntry* file_entry, ChunkList* chunks);
+
+// adds all files accepted by filter (or all files, if filter is NULL) to manifest->files, including their chunks
+void load_files(Manifest* manifest, FileFilter filter, void* filter_data);
+
+// load_files with the names, languages and chunk lists of the files allocated in arena instead of the manifest's
+// arena, for files that are only needed for a while
+void load_files_in(Manifest* manifest, FileFilter filter, void* filter_data, Arena* arena);
+
 Manifest* parse_manifest_data(uint8_t* data);
 Manifest* parse_manifest_f(char* filepath);
 
@@ -114,7 +153,9 @@ Manifest* parse_manifest_f(char* filepath);
     uint8_t*: parse_manifest_data \
 )(X)
 
+// groups chunks by bundle, sorted by bundle_id; each bundle's chunks are sorted by bundle_offset
 BundleList* group_by_bundles(ChunkList* chunks);
+void free_bundle_list(BundleList* bundles);
 
 bool chunk_valid(BinaryData* chunk, uint64_t chunk_id, HashType hashType);
 
@@ -9,6 +9,8 @@
     #include <ws2tcpip.h>
     #include <shlwapi.h>
 #endif
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -157,49 +159,81 @@ static int br_sslio_read_wrapper(void* cc, void* dst, size_t len) {return br_ssl
 static int br_sslio_read_all_wrapper(void* cc, void* dst, size_t len) {return br_sslio_read_all(cc, dst, len);}
 static int nossl_recv_wrapper(void* client_context, void* buffer, size_t len) {return recv_wrapper(client_context, buffer, len);}
 
-HttpResponse* receive_http_body(struct ssl_data* ssl_structs, const char* request)
+// dynamic function pointers; based on whether ssl functions or normal socket functions should be used
+struct http_io {
+    void* context;
+    int (*write_all)(void*, const void*, size_t);
+    int (*recv_once)(void*, void*, size_t);
+    int (*recv_all)(void*, void*, size_t);
+    bool is_ssl;
+};
+
+static struct http_io get_http_io(struct ssl_data* ssl_structs)
 {
-    // dynamic function pointers; based on whether ssl functions or normal socket functions should be used
-    void* io_context = &ssl_structs->ssl_io_context;
-    int (*write_all)(void*, const void*, size_t) = br_sslio_write_all_wrapper;
-    int (*recv_once)(void*, void*, size_t) = br_sslio_read_wrapper;
-    int (*recv_all)(void*, void*, size_t) = br_sslio_read_all_wrapper;
-    bool is_ssl = strcmp(ssl_structs->host_port->port, "443") == 0;
-    if (!is_ssl) {
-        io_context = &ssl_structs->socket;
-        write_all = send_data;
-        recv_once = nossl_recv_wrapper;
-        recv_all = receive_data;
+    if (strcmp(ssl_structs->host_port->port, "443") == 0) {
+        return (struct http_io) {
+            .context = &ssl_structs->ssl_io_context,
+            .write_all = br_sslio_write_all_wrapper,
+            .recv_once = br_sslio_read_wrapper,
+            .recv_all = br_sslio_read_all_wrapper,
+            .is_ssl = true
+        };
     }
+    return (struct http_io) {
+        .context = &ssl_structs->socket,
+        .write_all = send_data,
+        .recv_once = nossl_recv_wrapper,
+        .recv_all = receive_data,
+        .is_ssl = false
+    };
+}
 
-    int success = write_all(io_context, request, strlen(request));
-    if (is_ssl) {
-        br_sslio_flush(io_context);
-        int last_error = br_ssl_engine_last_error(&ssl_structs->ssl_client_context.eng);
-        if (last_error == BR_ERR_X509_NOT_TRUSTED) {
-            eprintf("Error: No certificate was valid for this server. Please report this.\n");
-            exit(EXIT_FAILURE);
-        } else if (last_error == BR_ERR_IO) { // assume socket was closed due to inactivity and try again
-            eprintf("Info: Underlying connection was closed. Trying again...\n");
-            refresh_connection(ssl_structs, is_ssl);
-            return receive_http_body(ssl_structs, request);
-        } else if (last_error != BR_ERR_OK) {
-            eprintf("bearssl engine reported error no. %d\n", last_error);
-            exit(EXIT_FAILURE);
+// Sends request and receives the response header into header_buffer (null-terminated), reconnecting first if the
+// connection was closed in the meantime. Returns the amount of bytes received, which may include the start of the
+// body, or -1.
+static int send_http_request(struct ssl_data* ssl_structs, const struct http_io* io, const char* request, char header_buffer[8193])
+{
+    while (1) {
+        int success = io->write_all(io->context, request, strlen(request));
+        if (io->is_ssl) {
+            br_sslio_flush(io->context);
+            int last_error = br_ssl_engine_last_error(&ssl_structs->ssl_client_context.eng);
+            if (last_error == BR_ERR_X509_NOT_TRUSTED) {
+                eprintf("Error: No certificate was valid for this server. Please report this.\n");
+                exit(EXIT_FAILURE);
+            } else if (last_error == BR_ERR_IO) { // assume socket was closed due to inactivity and try again
+                eprintf("Info: Underlying connection was closed. Trying again...\n");
+                refresh_connection(ssl_structs, io->is_ssl);
+                continue;
+            } else if (last_error != BR_ERR_OK) {
+                eprintf("bearssl engine reported error no. %d\n", last_error);
+                exit(EXIT_FAILURE);
+            }
+        } else if (success == -1) {
+            eprintf("Attempting reconnection...\n");
+            refresh_connection(ssl_structs, io->is_ssl);
+            continue;
         }
-    } else if (success == -1) {
-        eprintf("Attempting reconnection...\n");
-        refresh_connection(ssl_structs, is_ssl);
-        return receive_http_body(ssl_structs, request);
+        break;
     }
-    char header_buffer[8193] = {0};
+    memset(header_buffer, 0, 8193);
     int received = 0;
     do {
-        int bytes_read = recv_once(io_context, header_buffer + received, 8192 - received);
-        if (bytes_read == -1) return NULL;
+        int bytes_read = io->recv_once(io->context, header_buffer + received, 8192 - received);
+        if (bytes_read == -1) return -1;
         received += bytes_read;
     } while (!strstr(header_buffer, "\r\n\r\n"));
     dprintf("received header:\n\"%s\"\n", header_buffer);
+
+    return received;
+}
+
+HttpResponse* receive_http_body(struct ssl_data* ssl_structs, const char* request);
+
+// receives the rest of the response whose header (and received bytes of the body) are in header_buffer
+static HttpResponse* receive_response_body(struct ssl_data* ssl_structs, const struct http_io* io, const char* request, char* header_buffer, int received)
+{
+    bool is_ssl = io->is_ssl;
     bool refresh = strcasestr(header_buffer, "Connection: close\r\n");
     char* status_code = header_buffer + 9;
 
@@ -214,23 +248,27 @@ HttpResponse* receive_http_body(struct ssl_data* ssl_structs, const char* reques
         body->data = malloc(body->length);
         memcpy(body->data, start_of_body, already_received);
         dprintf("already received %d, will try to receive the rest %u\n", already_received, body->length - already_received);
-        if (recv_all(io_context, &body->data[already_received], body->length - already_received) != 0) return NULL;
+        if (io->recv_all(io->context, &body->data[already_received], body->length - already_received) != 0) return NULL;
     } else if (strcasestr(header_buffer, "Transfer-Encoding: chunked")) {
         // header contained the transfer-encoding: chunked header, which is difficult to handle (no content-length)
         char* start_of_chunk = start_of_body;
         char chunk_size_buffer[32] = {0};
+        uint64_t capacity = 0;
         while (1) {
             while (!strstr(start_of_chunk, "\r\n")) {
                 strcpy(chunk_size_buffer, start_of_chunk);
                 start_of_chunk = chunk_size_buffer;
-                int received = recv_once(io_context, &start_of_chunk[already_received], 31 - already_received);
+                int received = io->recv_once(io->context, &start_of_chunk[already_received], 31 - already_received);
                 if (received == -1) return NULL;
                 already_received += received;
             }
             int chunk_size = strtol(start_of_chunk, NULL, 16);
             if (!chunk_size) // chunk_size == 0, last chunk
                 break;
-            body->data = realloc(body->data, body->length + chunk_size);
+            if (body->length + chunk_size > capacity) {
+                capacity = max(body->length + chunk_size, capacity + (capacity >> 1));
+                body->data = realloc(body->data, capacity);
+            }
             char* body_position = strstr(start_of_chunk, "\r\n") + 2;
             already_received -= body_position - start_of_chunk;
             if (already_received >= chunk_size + 2) {
@@ -239,8 +277,8 @@ HttpResponse* receive_http_body(struct ssl_data* ssl_structs, const char* reques
                 already_received -= chunk_size + 2;
             } else {
                 memcpy(&body->data[body->length], body_position, already_received);
-                if (recv_all(io_context, &body->data[body->length + already_received], chunk_size - already_received) != 0 ||
-                    recv_all(io_context, &(uint16_t) {0}, 2) != 0) {
+                if (io->recv_all(io->context, &body->data[body->length + already_received], chunk_size - already_received) != 0 ||
+                    io->recv_all(io->context, &(uint16_t) {0}, 2) != 0) {
                     return NULL;
                 }
                 start_of_chunk = body_position + already_received;
@@ -250,7 +288,7 @@ HttpResponse* receive_http_body(struct ssl_data* ssl_structs, const char* reques
         }
         if (!strstr(start_of_chunk + 3, "\r\n")) {
             // in the rare case the final chunk size (0) was received, but not the last \r\n (should never happen)
-            recv_once(io_context, &(uint64_t) {0}, 8); // assume we get everything here
+            io->recv_once(io->context, &(uint64_t) {0}, 8); // assume we get everything here
         }
     } else {
         // no content-length field, so there is no way to know everything was received
@@ -260,7 +298,7 @@ HttpResponse* receive_http_body(struct ssl_data* ssl_structs, const char* reques
         uint64_t buffer_size = 8192 + (8192 >> 1);
         body->data = malloc(buffer_size);
         memcpy(body->data, start_of_body, already_received);
-        while ( (received = recv_once(io_context, &body->data[body->length], buffer_size - body->length)) != -1) {
+        while ( (received = io->recv_once(io->context, &body->data[body->length], buffer_size - body->length)) != -1) {
             body->length += received;
             if (body->length == buffer_size) {
                 buffer_size += buffer_size >> 1;
@@ -278,89 +316,215 @@ HttpResponse* receive_http_body(struct ssl_data* ssl_structs, const char* reques
                 exit(EXIT_FAILURE);
             }
         }
-        else assert(recv(*(SOCKET*) io_context, &(char) {0}, 1, 0) == 0);
+        else assert(recv(*(SOCKET*) io->context, &(char) {0}, 1, 0) == 0);
     }
     if (refresh) refresh_connection(ssl_structs, is_ssl);
     return body;
 }
 
-uint8_t** get_ranges(const char* bundle_path, const ChunkList* chunks)
+HttpResponse* receive_http_body(struct ssl_data* ssl_structs, const char* request)
+{
+    struct http_io io = get_http_io(ssl_structs);
+    char header_buffer[8193];
+    int received = send_http_request(ssl_structs, &io, request, header_buffer);
+    if (received == -1) return NULL;
+
+    return receive_response_body(ssl_structs, &io, request, header_buffer, received);
+}
+
+// chunks directly following the previous one in the bundle are part of its range
+static bool starts_range(const ChunkList* chunks, uint32_t i)
+{
+    return i == 0 || (chunks->objects[i-1].bundle_offset + chunks->objects[i-1].compressed_size != chunks->objects[i].bundle_offset
+        && chunks->objects[i-1].bundle_offset != chunks->objects[i].bundle_offset);
+}
+
+bool get_ranges(const char* bundle_path, const ChunkList* chunks, RangeSink* sink, IoEngine* io)
 {
-    FILE* bundle_file = fopen(bundle_path, "rb");
-    if (!bundle_file) {
+    int bundle_fd = open(bundle_path, O_RDONLY | O_BINARY);
+    if (bundle_fd == -1) {
         eprintf("Error: Failed to open file \"%s\"\n", bundle_path);
-        return NULL;
+        return false;
     }
 
-    uint8_t** ranges = malloc(chunks->length * sizeof(uint8_t*));
-    for (uint32_t i = 0; i < chunks->length; i++) {
-        fseek(bundle_file, chunks->objects[i].bundle_offset, SEEK_SET);
-        ranges[i] = malloc(chunks->objects[i].compressed_size);
-        assert(fread(ranges[i], chunks->objects[i].compressed_size, 1, bundle_file) == 1);
+    // chunks that follow each other in the bundle are read with a single request
+    for (uint32_t first = 0; first < chunks->length;) {
+        uint32_t end = first;
+        uint64_t window_size = 0;
+        do {
+            const Chunk* chunk = &chunks->objects[end];
+            if (end == first || chunks->objects[end-1].bundle_offset + chunks->objects[end-1].compressed_size != chunk->bundle_offset)
+                add_io_request(io, bundle_fd, chunk->bundle_offset);
+            add_io_vector(io, sink->buffer(sink->context, end), chunk->compressed_size);
+            window_size += chunk->compressed_size;
+            end++;
+        } while (end < chunks->length && window_size + chunks->objects[end].compressed_size <= READ_WINDOW_SIZE);
+        if (!run_io(io, false)) {
+            eprintf("Error: Failed to read chunks %016"PRIX64" to %016"PRIX64" from \"%s\"\n", chunks->objects[first].chunk_id, chunks->objects[end-1].chunk_id, bundle_path);
+            close(bundle_fd);
+            return false;
+        }
+        for (; first < end; first++) {
+            sink->done(sink->context, first);
+        }
     }
 
-    fclose(bundle_file);
-    return ranges;
+    close(bundle_fd);
+    return true;
 }
 
-static uint32_t response_to_ranges(HttpResponse* body, const ChunkList* chunks, uint8_t** ranges, uint32_t first_chunk, uint32_t count, uint32_list chunk_to_range_map)
+// Reads a response body piece by piece: multipart headers go through buffer, chunk data is received straight into
+// its destination. Also works on a body that was received completely already (io is NULL and buffer holds all of it).
+struct body_stream {
+    const struct http_io* io;
+    uint8_t* buffer;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    uint64_t remaining; // bytes of the body not consumed yet, buffered or not
+};
+
+// moves length bytes of the body to destination, or drops them if destination is NULL
+static bool stream_read(struct body_stream* stream, uint8_t* destination, uint64_t length)
 {
-    uint32_t chunks_handled = 0;
+    if (length > stream->remaining)
+        return false;
+    stream->remaining -= length;
+    size_t buffered = min((uint64_t) (stream->end - stream->start), length);
+    if (destination) {
+        memcpy(destination, &stream->buffer[stream->start], buffered);
+        destination += buffered;
+    }
+    stream->start += buffered;
+    length -= buffered;
+    if (length == 0)
+        return true;
+    if (destination)
+        return stream->io->recv_all(stream->io->context, destination, length) == 0;
+    // the buffer is empty at this point, so it can take the dropped data
+    stream->start = stream->end = 0;
+    while (length > 0) {
+        size_t piece = min(length, (uint64_t) stream->capacity);
+        if (stream->io->recv_all(stream->io->context, stream->buffer, piece) != 0)
+            return false;
+        length -= piece;
+    }
+
+    return true;
+}
 
-    if (body->status_code == 200) { // got the entire bundle instead of just the ranges (note: this is rare and i'm not sure why it happens)
-        for (uint32_t i = first_chunk; i < chunks->length; i++) {
-            ranges[i] = malloc(chunks->objects[i].compressed_size);
-            memcpy(ranges[i], &body->data[chunks->objects[i].bundle_offset], chunks->objects[i].compressed_size);
+// reads the header of the next part of a multipart body into header (null-terminated, cut off at header_size)
+static bool stream_read_part_header(struct body_stream* stream, char* header, size_t header_size)
+{
+    size_t header_length = 0;
+    while (1) {
+        for (size_t i = stream->start; i + 4 <= stream->end; i++) {
+            if (memcmp(&stream->buffer[i], "\r\n\r\n", 4) == 0) {
+                header_length = i + 4 - stream->start;
+                break;
+            }
         }
-        free(body->data);
-        chunks_handled = chunks->length - first_chunk;
-    } else if (count == 1) {
-        ranges[first_chunk] = body->data;
-        chunks_handled = 1;
-    } else {
-        char* pos = (char*) body->data;
-        // don't skip first range boundary delimiter if only one range was requested
-        if (chunk_to_range_map.objects[first_chunk + count - 1] != chunk_to_range_map.objects[first_chunk])
-            pos = strstr(pos, "\r\n\r\n") + 4;
-        for (uint32_t i = first_chunk; i < first_chunk + count; i++) {
-            if (i != first_chunk && chunk_to_range_map.objects[i] > chunk_to_range_map.objects[i-1])
-                pos = strstr(pos, "\r\n\r\n") + 4;
-            ranges[i] = malloc(chunks->objects[i].compressed_size);
-            memcpy(ranges[i], pos, chunks->objects[i].compressed_size);
-            if (i != first_chunk+count-1 && chunks->objects[i+1].bundle_offset > chunks->objects[i].bundle_offset)
-                pos += chunks->objects[i].compressed_size;
+        if (header_length)
+            break;
+        uint64_t unbuffered = stream->remaining - (stream->end - stream->start);
+        if (!stream->io || unbuffered == 0)
+            return false;
+        if (stream->end == stream->capacity) {
+            if (stream->start == 0)
+                return false;
+            memmove(stream->buffer, &stream->buffer[stream->start], stream->end - stream->start);
+            stream->end -= stream->start;
+            stream->start = 0;
         }
-        free(body->data);
-        chunks_handled = count;
+        // never beyond the body, the connection may be reused for the next request
+        int received = stream->io->recv_once(stream->io->context, &stream->buffer[stream->end], min((uint64_t) (stream->capacity - stream->end), unbuffered));
+        if (received == -1)
+            return false;
+        stream->end += received;
     }
-    free(body);
+    size_t copied = min(header_length, header_size - 1);
+    memcpy(header, &stream->buffer[stream->start], copied);
+    header[copied] = '\0';
+    stream->start += header_length;
+    stream->remaining -= header_length;
+
+    return true;
+}
+
+// gets the first and last byte of the bundle that a 206 response (or a part of it) contains
+static bool parse_content_range(const char* header, uint64_t* first_byte, uint64_t* last_byte)
+{
+    const char* content_range = strcasestr(header, "Content-Range:");
 
-    return chunks_handled;
+    return content_range && sscanf(content_range + 14, " bytes %"SCNu64"-%"SCNu64, first_byte, last_byte) == 2;
 }
 
-uint8_t** download_ranges(struct ssl_data* ssl_structs, const char* url, const ChunkList* chunks)
+// Hands the chunks contained in the response body to sink as soon as each of them was received, in order and
+// starting at first_chunk; at least requested_count of them. Returns the amount of chunks handled, or 0 on failure.
+static uint32_t stream_chunks(struct body_stream* stream, const char* header, int status_code, const ChunkList* chunks, uint32_t first_chunk, uint32_t requested_count, RangeSink* sink)
 {
-    uint32_list chunk_to_range_map;
-    initialize_list_size(&chunk_to_range_map, chunks->length);
-    add_object(&chunk_to_range_map, &(uint32_t) {0}); // first chunk is always at the beginning, so maps to the first range (0)
-    uint32_t last_range = 0;
-    for (uint32_t i = 1; i < chunks->length; i++) {
-        if (chunks->objects[i-1].bundle_offset + chunks->objects[i-1].compressed_size != chunks->objects[i].bundle_offset && chunks->objects[i-1].bundle_offset != chunks->objects[i].bundle_offset) {
-            last_range++;
+    // a 200 response is the entire bundle instead of just the ranges (note: this is rare and i'm not sure why it happens)
+    uint32_t last_chunk = status_code == 200 ? chunks->length : first_chunk + requested_count;
+    bool multipart = status_code == 206 && strcasestr(header, "multipart/byteranges");
+    uint64_t body_length = stream->remaining;
+    uint32_t next_chunk = first_chunk;
+    char part_header[1024];
+    while (next_chunk < last_chunk) {
+        uint64_t first_byte = 0, last_byte = body_length - 1;
+        if (multipart && !stream_read_part_header(stream, part_header, sizeof(part_header)))
+            return 0;
+        if (status_code == 206 && !parse_content_range(multipart ? part_header : header, &first_byte, &last_byte))
+            return 0;
+
+        uint64_t position = first_byte;
+        uint32_t part_first_chunk = next_chunk;
+        for (; next_chunk < last_chunk; next_chunk++) {
+            const Chunk* chunk = &chunks->objects[next_chunk];
+            if (chunk->bundle_offset < position || chunk->bundle_offset + chunk->compressed_size - 1 > last_byte)
+                break;
+            if (!stream_read(stream, NULL, chunk->bundle_offset - position)
+                || !stream_read(stream, sink->buffer(sink->context, next_chunk), chunk->compressed_size))
+                return 0;
+            sink->done(sink->context, next_chunk);
+            position = chunk->bundle_offset + chunk->compressed_size;
         }
-        add_object(&chunk_to_range_map, &(uint32_t) {last_range});
+        // parts are expected in the order they were requested in
+        if (next_chunk == part_first_chunk || !stream_read(stream, NULL, last_byte + 1 - position))
+            return 0;
+        if (!multipart)
+            break;
+    }
+    // the closing boundary of multipart bodies
+    if (!stream_read(stream, NULL, stream->remaining))
+        return 0;
+
+    return next_chunk - first_chunk;
+}
+
+static void print_download_error(struct ssl_data* ssl_structs, int status_code)
+{
+    if (status_code)
+        eprintf("Error: Got a %d response.\n", status_code);
+    else {
+        eprintf("Error: Failed to receive response data.\n");
+        if (strcmp(ssl_structs->host_port->port, "443") == 0)
+            eprintf("Bearssl error: %d\n", br_ssl_engine_last_error(&ssl_structs->ssl_client_context.eng));
+        else
+            eprintf("Error: %s\n", strerror(errno));
     }
+}
 
+bool download_ranges(struct ssl_data* ssl_structs, const char* url, const ChunkList* chunks, RangeSink* sink)
+{
     char request_header[8000];
     char current_range[23];
     uint32_t first_chunk = 0;
-    uint8_t** ranges = malloc(chunks->length * sizeof(char*));
 
     while (first_chunk < chunks->length) {
         uint32_t chunk_count = 0;
         sprintf(request_header, "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=", url + ssl_structs->host_port->path_offset, ssl_structs->host_port->host);
         for (uint32_t i = first_chunk, range_start_chunk = first_chunk; i < chunks->length; i++) {
-            if (i == chunks->length-1 || chunk_to_range_map.objects[i+1] != chunk_to_range_map.objects[i]) {
+            if (i == chunks->length-1 || starts_range(chunks, i + 1)) {
                 sprintf(current_range, "%u-%u", chunks->objects[range_start_chunk].bundle_offset, chunks->objects[i].bundle_offset + chunks->objects[i].compressed_size - 1);
                 range_start_chunk = i + 1;
 
@@ -379,30 +543,59 @@ uint8_t** download_ranges(struct ssl_data* ssl_structs, const char* url, const C
         strcat(request_header, "\r\n\r\n");
         dprintf("requesting %d chunk%s\n", chunk_count, chunk_count > 1 ? "s" : "");
         dprintf("request header:\n\"%s\"\n", request_header);
-        HttpResponse* body = receive_http_body(ssl_structs, request_header);
-        dprintf("status code: %d\n", body->status_code);
-        if (!body || body->status_code >= 400) {
-            if (body)
-                eprintf("Error: Got a %d response.\n", body->status_code);
-            else {
-                eprintf("Error: Failed to receive response data.\n");
-                if (strcmp(ssl_structs->host_port->port, "443") == 0)
-                    eprintf("Bearssl error: %d\n", br_ssl_engine_last_error(&ssl_structs->ssl_client_context.eng));
-                else
-                    eprintf("Error: %s\n", strerror(errno));
-            }
-            free(ranges);
-            return NULL;
+        struct http_io io = get_http_io(ssl_structs);
+        char header_buffer[8193];
+        int received = send_http_request(ssl_structs, &io, request_header, header_buffer);
+        int status_code = received == -1 ? 0 : strtol(header_buffer + 9, NULL, 10);
+        dprintf("status code: %d\n", status_code);
+        if (received == -1 || (status_code != 200 && status_code != 206)) {
+            print_download_error(ssl_structs, status_code);
+            return false;
         }
 
-        uint32_t chunks_handled = response_to_ranges(body, chunks, ranges, first_chunk, chunk_count, chunk_to_range_map);
-        assert(chunks_handled >= chunk_count);
+        char* start_of_body = strstr(header_buffer, "\r\n\r\n") + 4;
+        size_t already_received = received - (start_of_body - header_buffer);
+        char* content_length_position = strcasestr(header_buffer, "Content-Length:");
+        uint32_t chunks_handled;
+        if (content_length_position && !strcasestr(header_buffer, "Transfer-Encoding: chunked")) {
+            // chunks are passed on while the rest of the body is still being received
+            uint8_t stream_buffer[16384];
+            memcpy(stream_buffer, start_of_body, already_received);
+            struct body_stream stream = {
+                .io = &io,
+                .buffer = stream_buffer,
+                .capacity = sizeof(stream_buffer),
+                .remaining = strtoumax(content_length_position + 15, NULL, 10)
+            };
+            stream.end = min((uint64_t) already_received, stream.remaining);
+            chunks_handled = stream_chunks(&stream, header_buffer, status_code, chunks, first_chunk, chunk_count, sink);
+            if (strcasestr(header_buffer, "Connection: close\r\n"))
+                refresh_connection(ssl_structs, io.is_ssl);
+        } else {
+            // there's no telling where the body ends without receiving all of it first
+            HttpResponse* body = receive_response_body(ssl_structs, &io, request_header, header_buffer, received);
+            if (!body) {
+                print_download_error(ssl_structs, 0);
+                return false;
+            }
+            struct body_stream stream = {
+                .buffer = body->data,
+                .end = body->length,
+                .capacity = body->length,
+                .remaining = body->length
+            };
+            chunks_handled = stream_chunks(&stream, header_buffer, body->status_code, chunks, first_chunk, chunk_count, sink);
+            free(body->data);
+            free(body);
+        }
+        if (chunks_handled < chunk_count) {
+            eprintf("Error: Response doesn't contain the requested chunks.\n");
+            return false;
+        }
         first_chunk += chunks_handled;
     }
 
-    free(chunk_to_range_map.objects);
-
-    return ranges;
+    return true;
 }
 
 HttpResponse* download_url(const char* url)
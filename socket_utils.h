@@ -5,8 +5,10 @@
     #include <winsock2.h>
 #endif
 #include <inttypes.h>
+#include <stdbool.h>
 #include "BearSSL/inc/bearssl_ssl.h"
 
+#include "io_engine.h"
 #include "rman.h"
 
 #ifndef _WIN32
@@ -38,8 +40,26 @@ struct ssl_data {
 SOCKET __attribute__((warn_unused_result)) open_connection_s(const char* ip, const char* port);
 SOCKET __attribute__((warn_unused_result)) open_connection(uint32_t ip, uint16_t port);
 
-uint8_t** get_ranges(const char* path, const ChunkList* chunks);
-uint8_t** download_ranges(struct ssl_data* ssl_structs, const char* url, const ChunkList* chunks);
+// bundle data get_ranges reads with one batch of requests
+#define READ_WINDOW_SIZE (1024 * 1024)
+
+// Takes the compressed data of chunks while they're being read or downloaded: buffer(context, i) returns where that of
+// chunks->objects[i] is to be received to, done(context, i) is called once it's complete. Chunks come in order, but
+// buffers of up to READ_WINDOW_SIZE bytes of chunks may be asked for before the first of them is done.
+typedef struct range_sink {
+    uint8_t* (*buffer)(void* context, uint32_t chunk_index);
+    void (*done)(void* context, uint32_t chunk_index);
+    void* context;
+} RangeSink;
+
+// reads chunks (sorted by bundle_offset) from the bundle file at path into sink, in batches of up to READ_WINDOW_SIZE
+// bytes through io; returns false if not all could be read
+bool get_ranges(const char* path, const ChunkList* chunks, RangeSink* sink, IoEngine* io);
+
+// Downloads chunks (sorted by bundle_offset) from the bundle at url with as few range requests as possible. Every
+// chunk is passed to sink as soon as it was received, so only the chunk currently being received has to be buffered.
+// Returns false if not all chunks could be downloaded.
+bool download_ranges(struct ssl_data* ssl_structs, const char* url, const ChunkList* chunks, RangeSink* sink);
 
 HostPort* get_host_port(const char* url);
 